@@ -0,0 +1,195 @@
+// Kernel benchmark of the density evaluation: every kernel runs warmup
+// times and then reps times on one profiling queue. The device time of the
+// kernels and of the transfers comes from the SYCL events, the time to
+// write the output is measured once per kernel, and the results are
+// printed and optionally written as JSON for regression tracking.
+#include "Field.hpp"
+#include "Timer.hpp"
+#include "WaveFunction.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sycl/sycl.hpp>
+
+namespace {
+
+struct Stats {
+  double min, median, mean;
+};
+
+Stats stats(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  double sum = 0.0;
+  for (double x : v)
+    sum += x;
+  const size_t n = v.size();
+  return {v.front(), n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]),
+          sum / n};
+}
+
+struct Result {
+  std::string kernel;
+  Stats wall, device, transfer;
+  double io;
+  double pointsPerSecond;
+  double gflops;
+  size_t transferBytes;
+  size_t ioBytes;
+};
+
+std::string json(const Stats &s) {
+  std::ostringstream out;
+  out << "{\"min\": " << s.min << ", \"median\": " << s.median
+      << ", \"mean\": " << s.mean << "}";
+  return out.str();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> args;
+  std::vector<std::string> kernels = {"cpu", "sycl", "sycl2", "gemm",
+                                      "tiled", "native"};
+  std::string jsonFile;
+  int warmup = 1;
+  int reps = 5;
+  Format format = Format::Cube;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.rfind("--kernels=", 0) == 0) {
+      kernels.clear();
+      std::stringstream list(arg.substr(10));
+      std::string name;
+      while (std::getline(list, name, ','))
+        if (!name.empty())
+          kernels.push_back(name);
+    } else if (arg.rfind("--warmup=", 0) == 0)
+      warmup = std::stoi(arg.substr(9));
+    else if (arg.rfind("--reps=", 0) == 0)
+      reps = std::max(1, std::stoi(arg.substr(7)));
+    else if (arg.rfind("--json=", 0) == 0)
+      jsonFile = arg.substr(7);
+    else if (arg == "--format=bin")
+      format = Format::Binary;
+    else if (arg == "--format=cube")
+      format = Format::Cube;
+    else
+      args.push_back(arg);
+  }
+  if (args.size() != 3 && args.size() != 4) {
+    std::cout << " ./" << argv[0] << " foo.wfx rmin delta [tol]"
+              << " [--kernels=cpu,sycl,sycl2,gemm,tiled,native,...] [--warmup=1]"
+              << " [--reps=5] [--json=file] [--format=cube|bin]" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  Wavefunction wf;
+  wf.loadWF(args[0]);
+  const double rmin = std::stod(args[1]);
+  const double delta = std::stod(args[2]);
+  const double tol = args.size() == 4 ? std::stod(args[3]) : 0.0;
+
+  sycl::queue q(sycl::default_selector_v,
+                {sycl::property::queue::in_order(),
+                 sycl::property::queue::enable_profiling()});
+  const std::string deviceName =
+      q.get_device().get_info<sycl::info::device::name>();
+
+  // One field for every kernel: the wavefunction is uploaded once, by the
+  // first device evaluation
+  Field field(wf, rmin, delta, q);
+  field.setFormat(format);
+  if (tol > 0.0)
+    field.setCutoff(tol);
+  field.setDeferredOutput(true);
+  const size_t npoints = size_t(field.getPoints(0)) * field.getPoints(1) *
+                         field.getPoints(2);
+
+  std::vector<Result> results;
+  for (const auto &kernel : kernels) {
+    for (int r = 0; r < warmup; r++)
+      if (!field.evalKernel(kernel)) {
+        std::cerr << " Unknown kernel " << kernel << std::endl;
+        exit(EXIT_FAILURE);
+      }
+
+    std::vector<double> wall, device, transfer;
+    Timer timer;
+    for (int r = 0; r < reps; r++) {
+      timer.start();
+      if (!field.evalKernel(kernel)) {
+        std::cerr << " Unknown kernel " << kernel << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      timer.stop();
+      wall.push_back(timer.getDuration());
+      // host kernels have no events: their time is the wall time
+      const double t = field.kernelTime();
+      device.push_back(t > 0.0 ? t : timer.getDuration());
+      transfer.push_back(field.transferTime());
+    }
+
+    Timer io;
+    io.start();
+    field.writeOutput();
+    io.stop();
+
+    Result res;
+    res.kernel = kernel;
+    res.wall = stats(wall);
+    res.device = stats(device);
+    res.transfer = stats(transfer);
+    res.io = io.getDuration();
+    res.pointsPerSecond = npoints / (res.device.median * 1e-6);
+    res.gflops =
+        field.flopsPerPoint(kernel) * npoints / (res.device.median * 1e3);
+    res.transferBytes = field.transferBytes();
+    res.ioBytes = format == Format::Binary
+                      ? sizeof(double) * npoints
+                      : Field::cubeWidth * npoints + (npoints + 5) / 6;
+    results.push_back(res);
+  }
+
+  std::cout << std::endl << " Device : " << deviceName << std::endl;
+  std::cout << " Points : " << npoints << ", warmup " << warmup << ", reps "
+            << reps << " (median times in μ" << "s)" << std::endl;
+  for (const auto &r : results)
+    std::cout << " " << r.kernel << " : wall " << r.wall.median << ", kernel "
+              << r.device.median << ", transfer " << r.transfer.median
+              << ", io " << r.io << ", " << r.pointsPerSecond << " points/s, "
+              << r.gflops << " GFLOP/s" << std::endl;
+
+  if (!jsonFile.empty()) {
+    std::ofstream out(jsonFile);
+    if (!out.is_open()) {
+      std::cerr << " Error to open file " << jsonFile << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    out << "{\n  \"module\": \"02-electrondensity\",\n"
+        << "  \"device\": \"" << deviceName << "\",\n"
+        << "  \"input\": \"" << args[0] << "\",\n"
+        << "  \"points\": " << npoints << ",\n"
+        << "  \"warmup\": " << warmup << ",\n"
+        << "  \"reps\": " << reps << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      const Result &r = results[i];
+      out << (i ? "," : "") << "\n    {\"kernel\": \"" << r.kernel << "\""
+          << ", \"wall_us\": " << json(r.wall)
+          << ", \"kernel_us\": " << json(r.device)
+          << ", \"transfer_us\": " << json(r.transfer)
+          << ", \"io_us\": " << r.io
+          << ", \"points_per_s\": " << r.pointsPerSecond
+          << ", \"gflops\": " << r.gflops
+          << ", \"transfer_bytes\": " << r.transferBytes
+          << ", \"io_bytes\": " << r.ioBytes << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+}
@@ -0,0 +1,181 @@
+#include "Batch.hpp"
+#include "Timer.hpp"
+#include "WaveFunction.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include <sycl/sycl.hpp>
+
+std::vector<std::string> batchInputs(const std::string &path) {
+  std::vector<std::string> files;
+
+  if (std::filesystem::is_directory(path)) {
+    for (const auto &entry : std::filesystem::directory_iterator(path))
+      if (entry.is_regular_file() && entry.path().extension() == ".wfx")
+        files.push_back(entry.path().string());
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  std::ifstream list(path);
+  if (!list.is_open()) {
+    std::cerr << " Error to open file " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string line;
+  while (std::getline(list, line)) {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty() && line[0] != '#')
+      files.push_back(line);
+  }
+  return files;
+}
+
+namespace {
+
+// A molecule in flight: the field refers to the wavefunction, so both
+// travel together to the writer thread (field is destroyed first).
+struct Molecule {
+  std::unique_ptr<Wavefunction> wf;
+  std::unique_ptr<Field> field;
+};
+
+// Wavefunctions read ahead, and fields waiting for their writer: at most
+// batchDepth of each are resident besides the molecule on the device, so
+// the memory of a batch is bounded by the largest molecules and not by the
+// number of cores. Two already hide a load or a write behind a kernel.
+constexpr size_t batchDepth = 2;
+
+// The workers do not print: their errors reach the main thread through the
+// futures, and are reported there in the order of the files.
+std::unique_ptr<Wavefunction> load(std::string fname, bool sort) {
+  auto wf = std::make_unique<Wavefunction>();
+  wf->readWF(fname);
+  if (sort)
+    wf->sortPrimitives();
+  return wf;
+}
+
+// Output prefix of every input: its stem, and for stems shared by several
+// inputs (a/mol.wfx and b/mol.wfx) also its position in the batch, so that
+// no output overwrites another.
+std::vector<std::string> outputPrefixes(const std::vector<std::string> &files) {
+  std::map<std::string, int> uses;
+  std::vector<std::string> stems;
+  for (const auto &file : files) {
+    stems.push_back(std::filesystem::path(file).stem().string());
+    uses[stems.back()]++;
+  }
+  std::vector<std::string> prefixes;
+  for (size_t n = 0; n < files.size(); n++) {
+    if (uses[stems[n]] == 1) {
+      prefixes.push_back(stems[n] + "_");
+      continue;
+    }
+    const std::string name = stems[n] + "-" + std::to_string(n);
+    // the numbered name may itself be the stem of another input
+    if (uses.count(name)) {
+      std::cerr << " Output names of " << files[n]
+                << " clash with another input" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    prefixes.push_back(name + "_");
+    std::cout << " Output of " << files[n] << " : " << name << "_*"
+              << std::endl;
+  }
+  return prefixes;
+}
+
+} // namespace
+
+void runBatch(const std::vector<std::string> &files, const BatchOptions &opt) {
+  // One queue for the whole batch, so the kernels are built only once.
+  sycl::queue q(sycl::default_selector_v, sycl::property::queue::in_order());
+
+  std::deque<std::future<std::unique_ptr<Wavefunction>>> loads;
+  std::deque<std::future<void>> writes;
+  size_t next = 0;
+  auto prefetch = [&]() {
+    while (next < files.size() && loads.size() < batchDepth)
+      loads.push_back(
+          std::async(std::launch::async, load, files[next++], opt.sort));
+  };
+
+  std::cout << " Molecules : " << files.size() << std::endl;
+  const std::vector<std::string> prefixes = outputPrefixes(files);
+  Timer total, device;
+  double tdevice = 0.0;
+  total.start();
+  prefetch();
+
+  // A failed write is reported and the batch goes on; a failed load ends
+  // it, as it does for a single file.
+  auto collect = [](std::future<void> &write) {
+    try {
+      write.get();
+    } catch (const std::runtime_error &e) {
+      std::cerr << " " << e.what() << std::endl;
+    }
+  };
+
+  for (size_t n = 0; n < files.size(); n++) {
+    auto mol = std::make_unique<Molecule>();
+    try {
+      mol->wf = loads.front().get();
+    } catch (const std::runtime_error &e) {
+      std::cerr << " " << e.what() << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    loads.pop_front();
+    prefetch();
+
+    mol->field = std::make_unique<Field>(*mol->wf, opt.rmin, opt.delta, q);
+    Field &field = *mol->field;
+    field.setStrategy(opt.strategy);
+    field.setPrecision(opt.precision);
+    field.setWorkGroup(opt.workGroup);
+    field.setThreads(opt.threads);
+    field.setFormat(opt.format);
+    if (opt.tol > 0.0)
+      field.setCutoff(opt.tol);
+    field.setOutputPrefix(prefixes[n]);
+    field.setDeferredOutput(true);
+
+    device.start();
+    if (!field.evalKernel(opt.kernel)) {
+      std::cerr << " Unknown kernel " << opt.kernel << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    device.stop();
+    tdevice += device.getDuration();
+    field.releaseDevice();
+
+    if (writes.size() >= batchDepth) {
+      collect(writes.front());
+      writes.pop_front();
+    }
+    writes.push_back(std::async(std::launch::async,
+                                [mol = std::move(mol)]() {
+                                  mol->field->writeOutput();
+                                }));
+  }
+
+  for (auto &w : writes)
+    collect(w);
+  total.stop();
+
+  const double seconds = total.getDuration() * 1e-6;
+  std::cout << " Time for batch : " << total.getDuration() << " \u03BC"
+            << "s (" << tdevice << " \u03BC" << "s in " << opt.kernel << ")"
+            << std::endl;
+  std::cout << " Throughput : " << files.size() / seconds << " molecules/s"
+            << std::endl;
+}
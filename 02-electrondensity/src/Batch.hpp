@@ -0,0 +1,34 @@
+#ifndef _BATCH_HPP_
+#define _BATCH_HPP_
+
+#include "Field.hpp"
+#include <string>
+#include <vector>
+
+// Settings shared by every molecule of a batch run, and by the ranks of a
+// distributed run.
+struct BatchOptions {
+  double rmin;
+  double delta;
+  double tol;
+  std::string kernel;
+  bool sort;
+  Strategy strategy;
+  Precision precision;
+  Format format;
+  WorkGroup workGroup;
+  int threads;
+};
+
+// Expand a batch argument: a directory gives all its .wfx files, anything
+// else is read as a list with one file name per line.
+std::vector<std::string> batchInputs(const std::string &path);
+
+// Evaluate the density of every file on one queue. Host threads load the
+// next wavefunctions while the device works on the current one, and the
+// outputs are written asynchronously as <stem>_<kernel output>, or as
+// <stem>-<n>_<kernel output> for the n-th input (from 0) when several
+// inputs share a stem.
+void runBatch(const std::vector<std::string> &files, const BatchOptions &opt);
+
+#endif
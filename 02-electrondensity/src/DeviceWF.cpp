@@ -0,0 +1,107 @@
+#include "DeviceWF.hpp"
+
+#include <cmath>
+#include <limits>
+
+DeviceWF::DeviceWF(sycl::queue &queue, const Wavefunction &wf) : q(queue) {
+  revision = wf.revision;
+  natm = wf.natm;
+  norb = wf.norb;
+  npri = wf.npri;
+  nblk = wf.iblocks.size() - 1;
+
+  std::vector<double> xyz(3 * natm);
+  for (int i = 0; i < natm; i++) {
+    Rvector R(wf.atoms[i].coor);
+    xyz[3 * i] = R.get_x();
+    xyz[3 * i + 1] = R.get_y();
+    xyz[3 * i + 2] = R.get_z();
+  }
+
+  icnt = upload(wf.icntrs);
+  vang = upload(wf.vang);
+  blk = upload(wf.iblocks);
+  coor = upload(xyz);
+  depris = upload(wf.depris);
+  nocc = upload(wf.dnoccs);
+  coef = upload(wf.dcoefs);
+  cut2 = sycl::malloc_device<double>(npri, q);
+  bcut2 = sycl::malloc_device<double>(nblk, q);
+  dcut2 = sycl::malloc_device<double>(npri, q);
+  dbcut2 = sycl::malloc_device<double>(nblk, q);
+  dmat = nullptr;
+
+  scoor = uploadSingle(xyz);
+  sdepris = uploadSingle(wf.depris);
+  snocc = uploadSingle(wf.dnoccs);
+  scoef = uploadSingle(wf.dcoefs);
+  scut2 = sycl::malloc_device<float>(npri, q);
+  sbcut2 = sycl::malloc_device<float>(nblk, q);
+  q.wait();
+}
+
+DeviceWF::~DeviceWF() {
+  sycl::free(icnt, q);
+  sycl::free(vang, q);
+  sycl::free(blk, q);
+  sycl::free(coor, q);
+  sycl::free(depris, q);
+  sycl::free(cut2, q);
+  sycl::free(bcut2, q);
+  sycl::free(dcut2, q);
+  sycl::free(dbcut2, q);
+  sycl::free(nocc, q);
+  sycl::free(coef, q);
+  if (dmat)
+    sycl::free(dmat, q);
+  for (float *ptr : {scoor, sdepris, scut2, sbcut2, snocc, scoef})
+    sycl::free(ptr, q);
+}
+
+template <typename T> T *DeviceWF::upload(const std::vector<T> &v) {
+  T *ptr = sycl::malloc_device<T>(v.size(), q);
+  q.memcpy(ptr, v.data(), v.size() * sizeof(T));
+  return ptr;
+}
+
+float *DeviceWF::uploadSingle(const std::vector<double> &v) {
+  std::vector<float> sv(v.size());
+  for (size_t i = 0; i < v.size(); i++)
+    sv[i] = static_cast<float>(v[i]);
+  float *ptr = sycl::malloc_device<float>(sv.size(), q);
+  q.memcpy(ptr, sv.data(), sv.size() * sizeof(float)).wait();
+  return ptr;
+}
+
+void DeviceWF::setCutoffs(const std::vector<double> &c2,
+                          const std::vector<double> &bc2,
+                          const std::vector<double> &dc2,
+                          const std::vector<double> &dbc2) {
+  q.memcpy(cut2, c2.data(), npri * sizeof(double));
+  q.memcpy(bcut2, bc2.data(), nblk * sizeof(double));
+  q.memcpy(dcut2, dc2.data(), npri * sizeof(double));
+  q.memcpy(dbcut2, dbc2.data(), nblk * sizeof(double));
+
+  // Rounded up, so that no primitive kept in double precision is dropped
+  // in single precision; the unscreened cutoffs become infinite.
+  auto single = [](double c) {
+    const float inf = std::numeric_limits<float>::infinity();
+    if (c >= std::numeric_limits<float>::max())
+      return inf;
+    return std::nextafter(static_cast<float>(c), inf);
+  };
+  std::vector<float> sc2(npri), sbc2(nblk);
+  for (int j = 0; j < npri; j++)
+    sc2[j] = single(c2[j]);
+  for (int b = 0; b < nblk; b++)
+    sbc2[b] = single(bc2[b]);
+  q.memcpy(scut2, sc2.data(), npri * sizeof(float));
+  q.memcpy(sbcut2, sbc2.data(), nblk * sizeof(float));
+  q.wait();
+}
+
+void DeviceWF::setDensityMatrix(const std::vector<double> &p) {
+  if (!dmat)
+    dmat = sycl::malloc_device<double>(p.size(), q);
+  q.memcpy(dmat, p.data(), p.size() * sizeof(double)).wait();
+}
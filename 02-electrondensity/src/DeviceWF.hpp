@@ -0,0 +1,62 @@
+#ifndef _DEVICEWF_HPP_
+#define _DEVICEWF_HPP_
+
+#include "WaveFunction.hpp"
+#include <sycl/sycl.hpp>
+#include <vector>
+
+// Copy of a wavefunction resident in device memory (USM).  It is uploaded
+// once and shared by every kernel launched on the same queue, and by every
+// Field of the wavefunction built on it.
+class DeviceWF {
+public:
+  DeviceWF(sycl::queue &q, const Wavefunction &wf);
+  ~DeviceWF();
+  DeviceWF(const DeviceWF &) = delete;
+  DeviceWF &operator=(const DeviceWF &) = delete;
+
+  void setCutoffs(const std::vector<double> &cut2,
+                  const std::vector<double> &bcut2,
+                  const std::vector<double> &dcut2,
+                  const std::vector<double> &dbcut2);
+  void setDensityMatrix(const std::vector<double> &dmat);
+  sycl::queue &getQueue() { return q; }
+
+  // Field whose screening cutoffs were uploaded last
+  const void *cutoffOwner = nullptr;
+
+  unsigned revision; // of the wavefunction when uploaded
+  int natm;
+  int norb;
+  int npri;
+  int nblk;
+
+  int *icnt;
+  int *vang;
+  int *blk;
+  double *coor;
+  double *depris;
+  double *cut2;
+  double *bcut2;
+  double *dcut2; // cutoffs of the derivatives, for the deriv kernel
+  double *dbcut2;
+  double *nocc;
+  double *coef;
+  double *dmat;
+
+  // Single precision copies for the reduced precision kernels
+  float *scoor;
+  float *sdepris;
+  float *scut2;
+  float *sbcut2;
+  float *snocc;
+  float *scoef;
+
+private:
+  sycl::queue q;
+
+  template <typename T> T *upload(const std::vector<T> &v);
+  float *uploadSingle(const std::vector<double> &v);
+};
+
+#endif
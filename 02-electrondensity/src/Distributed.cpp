@@ -0,0 +1,155 @@
+#ifdef USE_MPI
+
+#include "Distributed.hpp"
+#include "Timer.hpp"
+#include "WaveFunction.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+#include <sycl/sycl.hpp>
+
+namespace {
+
+// Ranks sharing a node take its GPUs round robin; without GPUs every rank
+// uses the default device.
+sycl::queue rankQueue() {
+  MPI_Comm node;
+  int localRank;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+                      &node);
+  MPI_Comm_rank(node, &localRank);
+  MPI_Comm_free(&node);
+
+  const auto gpus = sycl::device::get_devices(sycl::info::device_type::gpu);
+  if (gpus.empty())
+    return sycl::queue(sycl::default_selector_v,
+                       sycl::property::queue::in_order());
+  return sycl::queue(gpus[localRank % gpus.size()],
+                     sycl::property::queue::in_order());
+}
+
+// MPI counts are ints, so big writes are split.
+void writeAt(MPI_File fh, MPI_Offset offset, const char *data, size_t len) {
+  const size_t maxWrite = size_t(1) << 30;
+  for (size_t done = 0; done < len; done += maxWrite) {
+    const int n = std::min(maxWrite, len - done);
+    MPI_File_write_at(fh, offset + done, data + done, n, MPI_CHAR,
+                      MPI_STATUS_IGNORE);
+  }
+}
+
+} // namespace
+
+void runDistributed(const std::string &file, const BatchOptions &opt) {
+  int rank, nranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nranks);
+
+  Timer total, eval, write;
+  total.start();
+
+  Wavefunction wf;
+  wf.loadWF(file);
+  if (opt.sort)
+    wf.sortPrimitives();
+
+  sycl::queue q = rankQueue();
+  Field field(wf, opt.rmin, opt.delta, q);
+  field.setStrategy(opt.strategy);
+  field.setPrecision(opt.precision);
+  field.setWorkGroup(opt.workGroup);
+  field.setThreads(opt.threads);
+  field.setFormat(opt.format);
+  if (opt.tol > 0.0)
+    field.setCutoff(opt.tol);
+  field.setDeferredOutput(true);
+
+  // The box is cut along x, the slowest axis of the output formats, so the
+  // slab of every rank is one contiguous range of the file.
+  const int nx = field.getPoints(0);
+  const int ny = field.getPoints(1);
+  const int nz = field.getPoints(2);
+  const double x0 = field.getOrigin(0);
+  const double y0 = field.getOrigin(1);
+  const double z0 = field.getOrigin(2);
+  const int first = int(long(nx) * rank / nranks);
+  const int count = int(long(nx) * (rank + 1) / nranks) - first;
+  const std::string header =
+      opt.format == Format::Binary
+          ? field.binaryHeader(x0, y0, z0, opt.delta, nx, ny, nz)
+          : field.cubeHeader(x0, y0, z0, opt.delta, nx, ny, nz);
+  field.setSlab(first, count);
+
+  eval.start();
+  if (count > 0 && !field.evalKernel(opt.kernel)) {
+    std::cerr << " Unknown kernel " << opt.kernel << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+  eval.stop();
+
+  const std::string fname =
+      opt.format == Format::Binary ? "densityMPI.bin" : "densityMPI.cube";
+  MPI_File fh;
+  if (MPI_File_open(MPI_COMM_WORLD, fname.c_str(),
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                    &fh) != MPI_SUCCESS) {
+    std::cerr << " Error to open file " << fname << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+  }
+
+  // Every rank builds the same header, so all of them know where the
+  // values start. A cube value g sits at header + 15 g + g / 6, after g / 6
+  // line breaks.
+  write.start();
+  const size_t ntotal = size_t(nx) * ny * nz;
+  const size_t g0 = size_t(first) * ny * nz;
+  const size_t n = size_t(count) * ny * nz;
+  const double *rho = field.getField().data();
+  MPI_File_set_size(fh, 0);
+  if (rank == 0)
+    writeAt(fh, 0, header.data(), header.size());
+  if (opt.format == Format::Binary) {
+    writeAt(fh, header.size() + sizeof(double) * g0,
+            reinterpret_cast<const char *>(rho), sizeof(double) * n);
+  } else {
+    std::vector<char> buffer(Field::cubeChunk * (Field::cubeWidth + 1));
+    for (size_t done = 0; done < n; done += Field::cubeChunk) {
+      const size_t g = g0 + done;
+      const size_t len =
+          Field::formatCube(rho + done, std::min(Field::cubeChunk, n - done),
+                            g, ntotal, buffer.data());
+      writeAt(fh, header.size() + Field::cubeWidth * g + g / 6, buffer.data(),
+              len);
+    }
+  }
+  MPI_File_close(&fh);
+  write.stop();
+  total.stop();
+
+  // Strong scaling: the slowest rank sets the pace.
+  double local[3] = {eval.getDuration(), write.getDuration(),
+                     total.getDuration()};
+  double tmax[3], tmin[3], tsum[3];
+  MPI_Reduce(local, tmax, 3, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(local, tmin, 3, MPI_DOUBLE, MPI_MIN, 0, MPI_COMM_WORLD);
+  MPI_Reduce(local, tsum, 3, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (rank != 0)
+    return;
+
+  const char *names[3] = {opt.kernel.c_str(), "write", "total"};
+  std::cout << " Ranks : " << nranks << std::endl;
+  std::cout << " Points ( " << nx << "," << ny << "," << nz << ")"
+            << std::endl;
+  for (int t = 0; t < 3; t++)
+    std::cout << " Time for " << names[t] << " : " << tmax[t] << " \u03BC"
+              << "s (min " << tmin[t] << ", avg " << tsum[t] / nranks << ")"
+              << std::endl;
+  std::cout << " Throughput : " << ntotal / (tmax[0] * 1e-6) << " points/s"
+            << std::endl;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _DISTRIBUTED_HPP_
+#define _DISTRIBUTED_HPP_
+
+#ifdef USE_MPI
+
+#include "Batch.hpp"
+#include <string>
+
+// Evaluate the density of one molecule over all ranks of MPI_COMM_WORLD.
+// Every rank takes a slab of whole x planes of the box, evaluated by the
+// kernel of opt on one device of its node, and writes it straight to its
+// place in density<MPI>.cube or .bin with MPI-IO: the field is never
+// gathered on one rank. The timings of the ranks are reduced and printed
+// by rank 0. Must be called between MPI_Init and MPI_Finalize.
+void runDistributed(const std::string &file, const BatchOptions &opt);
+
+#endif
+
+#endif
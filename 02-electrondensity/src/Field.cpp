@@ -1,26 +1,389 @@
 #include "Field.hpp"
 #include "Atom.hpp"
+#include "Timer.hpp"
 #include "WaveFunction.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 
 #include <sycl/sycl.hpp>
 
-Field::Field(Wavefunction &wf, double rmin, double delta) : wf(wf), xmin(rmin), ymin(rmin), zmin(rmin), delta(delta){
+Field::Field(Wavefunction &wf, double rmin, double delta) : wf(wf), xmin(rmin), ymin(rmin), zmin(rmin), delta(delta),
+    q(sycl::default_selector_v, sycl::property::queue::in_order()) {
+    setGrid();
+}
+
+Field::Field(Wavefunction &wf, double rmin, double delta, sycl::queue &queue)
+    : wf(wf), xmin(rmin), ymin(rmin), zmin(rmin), delta(delta), q(queue) {
+    setGrid();
+}
 
+Field::Field(Wavefunction &wf, double rmin, double delta,
+             std::shared_ptr<DeviceWF> device)
+    : wf(wf), xmin(rmin), ymin(rmin), zmin(rmin), delta(delta),
+      q(device->getQueue()), dwf(std::move(device)) {
+    setGrid();
+}
+
+Field::~Field() {
+    releaseDevice();
+}
+
+void Field::setPoints() {
     npoints_x = static_cast<int>(fabs(2.*xmin / delta));
     npoints_y = static_cast<int>(fabs(2.*ymin / delta));
     npoints_z = static_cast<int>(fabs(2.*zmin / delta));
 
-    nsize = npoints_x * npoints_y * npoints_z;
+    nsize = size_t(npoints_x) * npoints_y * npoints_z;
+}
+
+void Field::setGrid() {
+    setPoints();
+
+    d_rho = nullptr;
+    d_srho = nullptr;
+    d_scratch = nullptr;
+    nscratch = 0;
+    nbytes = 0;
+    onDevice = false;
+    hostResult = true;
+
+    setCutoff(0.0);
+    strategy = Strategy::Auto;
+    precision = Precision::Double;
+    workGroup = {0, 0};
+    threads = 0;
+    rhoRefine = 5.e-2;
+    gradRefine = 1.e-1;
+    format = Format::Cube;
+    deferred = false;
+}
+
+void Field::setSlab(int first, int count) {
+    xmin += first * delta;
+    npoints_x = count;
+    nsize = size_t(npoints_x) * npoints_y * npoints_z;
+}
+
+bool Field::evalKernel(const std::string &kernel) {
+    checkOrder();
+    leaves.clear();
+    evaluated.clear();
+    grad.clear();
+    lap.clear();
+    kernelEvents.clear();
+    transferEvents.clear();
+    nbytes = 0;
+    if (kernel == "auto") {
+        const std::string name = q.get_device().is_gpu() ? "sycl2" : "native";
+        std::cout << " Kernel : " << name << std::endl;
+        return evalKernel(name);
+    }
+    if (kernel == "cpu")
+        evalDensity2();
+    else if (kernel == "sycl")
+        evalDensity_sycl();
+    else if (kernel == "sycl2")
+        evalDensity_sycl2();
+    else if (kernel == "gemm")
+        evalDensity_gemm();
+    else if (kernel == "multi")
+        evalDensity_multi();
+    else if (kernel == "adaptive")
+        evalDensity_adaptive();
+    else if (kernel == "deriv")
+        evalDerivatives();
+    else if (kernel == "tiled")
+        evalDensity_tiled();
+    else if (kernel == "native")
+        evalDensity_native();
+    else
+        return false;
+    return true;
+}
+
+void Field::setGrid(double rmin, double spacing) {
+    q.wait();
+    if (d_rho)
+        sycl::free(d_rho, q);
+    if (d_srho)
+        sycl::free(d_srho, q);
+    if (d_scratch)
+        sycl::free(d_scratch, q);
+    d_rho = nullptr;
+    d_srho = nullptr;
+    d_scratch = nullptr;
+    nscratch = 0;
+    onDevice = false;
+
+    xmin = ymin = zmin = rmin;
+    delta = spacing;
+    setPoints();
+    rho.clear();
+    grad.clear();
+    lap.clear();
+    leaves.clear();
+    evaluated.clear();
+}
+
+// The primitives are indexed in the order of the wavefunction, which
+// sortPrimitives() may have changed since the cutoffs were computed or the
+// device copies uploaded: both are then redone in the current order.
+void Field::checkOrder() {
+    if (cutoffRevision == wf.revision)
+        return;
+    if (dwf && dwf->cutoffOwner == this)
+        dwf->cutoffOwner = nullptr;
+    if (dwf && dwf->revision != wf.revision)
+        dwf.reset();
+    mdwf.clear();
+    setCutoff(tol);
+}
+
+// The wavefunction is uploaded on the first device evaluation only. A copy
+// shared with other Fields gets the cutoffs of this one whenever another
+// Field uploaded its own since.
+DeviceWF &Field::device() {
+    checkOrder();
+    if (!dwf || dwf->revision != wf.revision)
+        dwf = std::make_shared<DeviceWF>(q, wf);
+    if (dwf->cutoffOwner != this) {
+        dwf->setCutoffs(cut2, bcut2, dcut2, dbcut2);
+        dwf->cutoffOwner = this;
+    }
+    return *dwf;
+}
+
+std::shared_ptr<DeviceWF> Field::deviceWF() {
+    device();
+    return dwf;
+}
+
+void Field::releaseDevice() {
+    if (dwf && dwf->cutoffOwner == this)
+        dwf->cutoffOwner = nullptr;
+    dwf.reset();
+    mdwf.clear();
+    if (d_rho)
+        sycl::free(d_rho, q);
+    if (d_srho)
+        sycl::free(d_srho, q);
+    if (d_scratch)
+        sycl::free(d_scratch, q);
+    d_rho = nullptr;
+    d_srho = nullptr;
+    d_scratch = nullptr;
+    nscratch = 0;
+    onDevice = false;
+}
+
+// Every device kernel writes its result here; the flag is cleared again by
+// the cpu kernel, which only fills rho.
+double *Field::deviceField() {
+    if (!d_rho)
+        d_rho = sycl::malloc_device<double>(nsize, q);
+    onDevice = true;
+    return d_rho;
+}
+
+void Field::fetchResult() {
+    if (hostResult)
+        recordTransfer(q.memcpy(rho.data(), d_rho, nsize * sizeof(double)),
+                       nsize * sizeof(double));
+    q.wait();
+}
+
+template <> double *Field::deviceOutput<double>() { return deviceField(); }
+
+// d_rho does not hold this result: deviceResult() uploads the widened one.
+template <> float *Field::deviceOutput<float>() {
+    if (!d_srho)
+        d_srho = sycl::malloc_device<float>(nsize, q);
+    onDevice = false;
+    return d_srho;
+}
+
+template <> void Field::fetchOutput<double>() { fetchResult(); }
+
+// Always fetched, also without a host result: the widening needs it.
+template <> void Field::fetchOutput<float>() {
+    std::vector<float> single(nsize);
+    recordTransfer(q.memcpy(single.data(), d_srho, nsize * sizeof(float)),
+                   nsize * sizeof(float));
+    q.wait();
+    std::copy(single.begin(), single.end(), rho.begin());
+}
+
+double Field::eventTime(const std::vector<sycl::event> &events) const {
+    if (!q.has_property<sycl::property::queue::enable_profiling>())
+        return 0.0;
+    double ns = 0.0;
+    for (const auto &e : events)
+        ns += e.get_profiling_info<sycl::info::event_profiling::command_end>() -
+              e.get_profiling_info<sycl::info::event_profiling::command_start>();
+    return ns * 1.e-3;
+}
+
+// Per point the orbital kernels compute 8 operations per block of
+// primitives (distance) and per primitive 5 plus its angular powers, for
+// each orbital, and 3 per orbital for the density. The gemm kernel
+// evaluates the primitives once and then contracts them, as does the native
+// kernel over the orbitals, the tiled kernel once per block of tiledOrbitals
+// orbitals.
+double Field::flopsPerPoint(const std::string &kernel) {
+    double powers = 0.0;
+    for (int j = 0; j < wf.npri; j++)
+        powers += std::max(0, wf.vang[3 * j] - 1) +
+                  std::max(0, wf.vang[3 * j + 1] - 1) +
+                  std::max(0, wf.vang[3 * j + 2] - 1);
+    const double nblk = wf.iblocks.size() - 1;
+    const double prims = 8.0 * nblk + 5.0 * wf.npri + powers;
+    if (kernel == "gemm") {
+        const double nrow = useDensityMatrix() ? wf.npri : wf.norb;
+        return prims + 2.0 * wf.npri * nrow + 3.0 * nrow;
+    }
+    if (kernel == "native")
+        return prims + 2.0 * wf.npri * wf.norb + 3.0 * wf.norb;
+    if (kernel == "tiled") {
+        const double nblock = (wf.norb + tiledOrbitals - 1) / tiledOrbitals;
+        return nblock * prims + 2.0 * wf.npri * wf.norb + 3.0 * wf.norb;
+    }
+    // the derivatives cost about three times the value per primitive
+    const double scale = kernel == "deriv" ? 3.0 : 1.0;
+    return wf.norb * (scale * prims + 3.0);
+}
+
+const double *Field::deviceResult() {
+    if (!onDevice)
+        q.memcpy(deviceField(), rho.data(), nsize * sizeof(double)).wait();
+    return d_rho;
+}
+
+double *Field::deviceScratch(size_t n) {
+    if (n > nscratch) {
+        if (d_scratch)
+            sycl::free(d_scratch, q);
+        d_scratch = sycl::malloc_device<double>(n, q);
+        nscratch = n;
+    }
+    return d_scratch;
+}
+
+// Per point the orbital path costs norb * npri multiply-adds and the
+// density-matrix path npri * npri, on top of the same primitive evaluation.
+// The matrix is only considered while it fits comfortably in memory.
+bool Field::useDensityMatrix() {
+  if (strategy != Strategy::Auto)
+    return strategy == Strategy::DensityMatrix;
+
+  const double dmatBytes = 8.0 * wf.npri * wf.npri;
+  return wf.npri < wf.norb && dmatBytes < 1.e9;
 }
 
-double Field::Density(int norb, int npri, const int *icnt, const int *vang,
-                           const double *r, const double *coor,
-                           const double *depris, const double *nocc,
-                           const double *coef) {
+// Squared radius beyond which k r^p exp(-a r^2) stays below tol, or 0 if
+// it never reaches tol. The bound peaks at r^2 = p/(2a), so past the
+// returned radius it only decreases.
+static double screenRadius2(double k, int p, double alpha, double tol) {
+  if (k == 0.0)
+    return 0.0;
+  const double lnr = log(k / tol);
+  const double rpeak2 = 0.5 * p / alpha;
+  const double lnpeak = (p > 0 ? 0.5 * p * log(rpeak2) : 0.0) - alpha * rpeak2;
+  if (lnpeak < -lnr)
+    return 0.0;
+  if (p == 0)
+    return lnr / alpha;
+
+  // Outermost root of a r^2 = ln(k/tol) + p/2 ln(r^2), approached from
+  // above by fixed-point iteration.
+  double r2 = (fabs(lnr) + p) / alpha + rpeak2;
+  for (int it = 0; it < 50; it++) {
+    const double next = (lnr + 0.5 * p * log(r2)) / alpha;
+    if (fabs(next - r2) < 1.e-10 * r2) {
+      r2 = next;
+      break;
+    }
+    r2 = next;
+  }
+  return std::max(r2, rpeak2);
+}
+
+void Field::setCutoff(double tolerance) {
+  tol = tolerance;
+  cutoffRevision = wf.revision;
+  const size_t nblk = wf.iblocks.size() - 1;
+  cut2.assign(wf.npri, std::numeric_limits<double>::max());
+  bcut2.assign(nblk, std::numeric_limits<double>::max());
+  dcut2.assign(wf.npri, std::numeric_limits<double>::max());
+  dbcut2.assign(nblk, std::numeric_limits<double>::max());
+  if (tol > 0.0) {
+    for (int j = 0; j < wf.npri; j++) {
+      const int L = wf.vang[3 * j] + wf.vang[3 * j + 1] + wf.vang[3 * j + 2];
+      const double a = wf.depris[j];
+
+      double cmax = 0.0;
+      for (int i = 0; i < wf.norb; i++)
+        cmax = std::max(cmax, fabs(wf.dcoefs[i * wf.npri + j]));
+
+      // |c (x-X)^lx (y-Y)^ly (z-Z)^lz exp(-a r^2)| <= cmax r^L exp(-a r^2)
+      cut2[j] = screenRadius2(cmax, L, a, tol);
+
+      // The derivatives of the primitive grow as 2a r and 4a^2 r^2 relative
+      // to the value, so they need radii of their own. Per term,
+      //   |d/dx g| <= (L r^(L-1) + 2a r^(L+1)) exp(-a r^2)
+      //   |lap g|  <= (L(L-1) r^(L-2) + 2a(2L+3) r^L + 4a^2 r^(L+2)) exp(-a r^2)
+      // and each of the (at most three) terms is kept below tol/3.
+      const double k[6] = {1.0,
+                           double(L),
+                           2.0 * a,
+                           double(L * (L - 1)),
+                           2.0 * a * (2 * L + 3),
+                           4.0 * a * a};
+      const int p[6] = {L, L - 1, L + 1, L - 2, L, L + 2};
+      dcut2[j] = 0.0;
+      for (int t = 0; t < 6; t++)
+        if (p[t] >= 0)
+          dcut2[j] = std::max(dcut2[j],
+                              screenRadius2(k[t] * cmax, p[t], a, tol / 3.0));
+    }
+
+    // A whole center is dropped once the point is beyond all its
+    // primitives.
+    for (size_t b = 0; b < nblk; b++) {
+      bcut2[b] = dbcut2[b] = 0.0;
+      for (int j = wf.iblocks[b]; j < wf.iblocks[b + 1]; j++) {
+        bcut2[b] = std::max(bcut2[b], cut2[j]);
+        dbcut2[b] = std::max(dbcut2[b], dcut2[j]);
+      }
+    }
+  }
+
+  if (dwf) {
+    dwf->setCutoffs(cut2, bcut2, dcut2, dbcut2);
+    dwf->cutoffOwner = this;
+  }
+  for (auto &d : mdwf)
+    if (d)
+      d->setCutoffs(cut2, bcut2, dcut2, dbcut2);
+}
+
+double Field::Density(int norb, int npri, int nblk, const int *blk,
+                      const int *icnt, const int *vang, const double *r,
+                      const double *coor, const double *depris,
+                      const double *cut2, const double *bcut2,
+                      const double *nocc, const double *coef) {
   double den = 0.0;
   const double x = r[0];
   const double y = r[1];
@@ -29,23 +392,68 @@ double Field::Density(int norb, int npri, const int *icnt, const int *vang,
   for (int i = 0; i < norb; i++) {
     double mo = 0.0;
     const int i_prim = i * npri;
-    for (int j = 0; j < npri; j++) {
-      const int vj = 3 * j;
-      const int centerj = 3 * icnt[j];
+    // Primitives come in blocks sharing the same center, so the distance
+    // to the nucleus is computed once per block.
+    for (int b = 0; b < nblk; b++) {
+      const int centerj = 3 * icnt[blk[b]];
       const double difx = x - coor[centerj];
       const double dify = y - coor[centerj + 1];
       const double difz = z - coor[centerj + 2];
       const double rr = difx * difx + dify * dify + difz * difz;
+      if (rr > bcut2[b])
+        continue;
+
+      for (int j = blk[b]; j < blk[b + 1]; j++) {
+        if (rr > cut2[j])
+          continue;
+        const int vj = 3 * j;
+        const double expo = exp(-depris[j] * rr);
+        const double facx = ipow(difx, vang[vj]);
+        const double facy = ipow(dify, vang[vj + 1]);
+        const double facz = ipow(difz, vang[vj + 2]);
+
+        mo += facx * facy * facz * expo * coef[i_prim + j];
+      }
+    }
+    den += nocc[i] * mo * mo;
+  }
+
+  return den;
+}
+
+template <class Real, class Acc>
+Acc Field::DensityT(int norb, int npri, int nblk, const int *blk,
+                    const int *icnt, const int *vang, const Real *r,
+                    const Real *coor, const Real *depris, const Real *cut2,
+                    const Real *bcut2, const Acc *nocc, const Acc *coef) {
+  Acc den = 0;
+  const Real x = r[0];
+  const Real y = r[1];
+  const Real z = r[2];
 
-      const double expo = exp(-depris[j] * rr);
-      const double lx = vang[vj];
-      const double ly = vang[vj + 1];
-      const double lz = vang[vj + 2];
-      const double facx = pow(difx, lx);
-      const double facy = pow(dify, ly);
-      const double facz = pow(difz, lz);
+  for (int i = 0; i < norb; i++) {
+    Acc mo = 0;
+    const int i_prim = i * npri;
+    for (int b = 0; b < nblk; b++) {
+      const int centerj = 3 * icnt[blk[b]];
+      const Real difx = x - coor[centerj];
+      const Real dify = y - coor[centerj + 1];
+      const Real difz = z - coor[centerj + 2];
+      const Real rr = difx * difx + dify * dify + difz * difz;
+      if (rr > bcut2[b])
+        continue;
+
+      for (int j = blk[b]; j < blk[b + 1]; j++) {
+        if (rr > cut2[j])
+          continue;
+        const int vj = 3 * j;
+        const Real expo = sycl::exp(-depris[j] * rr);
+        const Real facx = ipow(difx, vang[vj]);
+        const Real facy = ipow(dify, vang[vj + 1]);
+        const Real facz = ipow(difz, vang[vj + 2]);
 
-      mo += facx * facy * facz * expo * coef[i_prim + j];
+        mo += Acc(facx * facy * facz * expo) * coef[i_prim + j];
+      }
     }
     den += nocc[i] * mo * mo;
   }
@@ -53,12 +461,28 @@ double Field::Density(int norb, int npri, const int *icnt, const int *vang,
   return den;
 }
 
+// The double precision reference is Density() itself.
+template <>
+double Field::DensityT<double, double>(
+    int norb, int npri, int nblk, const int *blk, const int *icnt,
+    const int *vang, const double *r, const double *coor,
+    const double *depris, const double *cut2, const double *bcut2,
+    const double *nocc, const double *coef) {
+  return Density(norb, npri, nblk, blk, icnt, vang, r, coor, depris, cut2,
+                 bcut2, nocc, coef);
+}
+
 
-//#include "functioncpu.xx"
+#include "functioncpu.xx"
 
-//#include "function1d.xx"
+#include "function1d.xx"
 #include "function3d.xx"
-//#include "evaldensobj.cxx"
+#include "functiongemm.xx"
+#include "functionmulti.xx"
+#include "functionadaptive.xx"
+#include "functionderiv.xx"
+#include "functiontiled.xx"
+#include "functionnative.xx"
 
 
 
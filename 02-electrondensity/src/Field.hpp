@@ -1,98 +1,253 @@
 #ifndef _FIELD_HPP_
 #define _FIELD_HPP_
 
+#include "DeviceWF.hpp"
 #include "WaveFunction.hpp"
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <sycl/sycl.hpp>
 #include <vector>
 
+// (x - X)^l for the Cartesian exponents of a primitive, l = 0..5 (types 1 to
+// 56 of the WFX format), using multiplications only, all in T.
+template <int L, class T> inline T ipow(T x) {
+  if constexpr (L == 0)
+    return T(1);
+  else
+    return x * ipow<L - 1>(x);
+}
+
+template <class T> inline T ipow(T x, int l) {
+  switch (l) {
+  case 0:
+    return ipow<0>(x);
+  case 1:
+    return ipow<1>(x);
+  case 2:
+    return ipow<2>(x);
+  case 3:
+    return ipow<3>(x);
+  case 4:
+    return ipow<4>(x);
+  case 5:
+    return ipow<5>(x);
+  default: {
+    T p = ipow<5>(x);
+    for (int m = 5; m < l; m++)
+      p *= x;
+    return p;
+  }
+  }
+}
+
+// How the two-stage kernel contracts the primitives: through the occupied
+// orbitals, or through the primitive density matrix.
+enum class Strategy { Auto, Orbital, DensityMatrix };
+
+// Arithmetic of the sycl2 kernel: all double; float coordinates,
+// exponentials and angular factors with the orbitals accumulated in
+// double; or all float.
+enum class Precision { Double, Mixed, Single };
+
+// Output of the evaluated field: Gaussian cube text or raw binary.
+enum class Format { Cube, Binary };
+
+// Work-items along y and z of a work-group of the tiled kernel; zero
+// leaves the shape to the tuner.
+struct WorkGroup {
+  int y;
+  int z;
+};
+
+// Cell of the adaptive grid: the points lo..hi, inclusive, of each axis.
+struct OctreeCell {
+  int lo[3];
+  int hi[3];
+};
+
 class Field {
 public:
   Field(Wavefunction &wf, double rmin, double delta);
+  // The queue must be in-order; the kernels rely on it for their
+  // dependencies.
+  Field(Wavefunction &wf, double rmin, double delta, sycl::queue &queue);
+  // On the device copy of wf held by another Field, see deviceWF(), and on
+  // its queue: further grids of a molecule are not uploaded again.
+  Field(Wavefunction &wf, double rmin, double delta,
+        std::shared_ptr<DeviceWF> device);
+  ~Field();
+  Field(const Field &) = delete;
+  Field &operator=(const Field &) = delete;
 
-  double orbital(Rvector r, int i);
-  double gaussiana(Rvector r, int mu);
-  double Density(Rvector r);
-  void evalDensity();
   void evalDensity2();
   void evalDensity2D();
 
   void evalDensity_sycl();
   void evalDensity_sycl2();
-  static SYCL_EXTERNAL double Density(int, int, const int *, const int *,
-                                           const double *, const double *,
-                                           const double *, const double *,
-                                           const double *);
+  void evalDensity_gemm();
+  // The evalDensity_sycl2 kernel over slabs of x planes spread across every
+  // GPU, or every tile of a multi-tile GPU, of the node.
+  void evalDensity_multi();
+  // Octree refinement of cells of adaptiveCell points per side: only the
+  // corners of the cells are evaluated, the rest of the grid is
+  // interpolated. The leaves are written next to the field, see
+  // dumpOctree().
+  void evalDensity_adaptive();
+  // Density with its analytic gradient and Laplacian, see getGradient()
+  // and getLaplacian().
+  void evalDerivatives();
+  // nd_range kernel with the primitives and coefficients staged in local
+  // memory, tiledPoints z points and tiledOrbitals orbitals at a time per
+  // work-item, see setWorkGroup().
+  void evalDensity_tiled();
+  // Host threads over the (x, y) lines of the grid, nativeLanes z points at
+  // a time in vector registers, see setThreads().
+  void evalDensity_native();
+  // Run the named kernel (cpu, sycl, sycl2, gemm, multi, adaptive, deriv,
+  // tiled or native); false if unknown. auto runs sycl2 when the queue is on
+  // a GPU and native otherwise.
+  bool evalKernel(const std::string &kernel);
+  static SYCL_EXTERNAL double Density(int, int, int, const int *,
+                                      const int *, const int *,
+                                      const double *, const double *,
+                                      const double *, const double *,
+                                      const double *, const double *,
+                                      const double *);
+  // Density() with out = {rho, d/dx, d/dy, d/dz, laplacian} of the density.
+  static SYCL_EXTERNAL void DensityDerivatives(
+      int, int, int, const int *, const int *, const int *, const double *,
+      const double *, const double *, const double *, const double *,
+      const double *, const double *, double *out);
+  // Density() computed in Real, with the molecular orbitals and the density
+  // accumulated in Acc.
+  template <class Real, class Acc>
+  static SYCL_EXTERNAL Acc DensityT(int, int, int, const int *, const int *,
+                                    const int *, const Real *, const Real *,
+                                    const Real *, const Real *, const Real *,
+                                    const Acc *, const Acc *);
+
+  // Primitive screening: skip |c_ij g_j(r)| < tol for every orbital i.
+  // A tolerance <= 0 disables the screening.
+  void setCutoff(double tol);
+
+  // Thresholds of the adaptive kernel: a cell is refined while a corner
+  // has a density above rho, or the density changes by more than grad per
+  // bohr across it. Cells with a nucleus are always refined.
+  void setRefinement(double rho, double grad) {
+    rhoRefine = rho;
+    gradRefine = grad;
+  }
+  static constexpr int adaptiveCell = 8;
+
+  void setStrategy(Strategy s) { strategy = s; }
+  void setPrecision(Precision p) { precision = p; }
+  // Work-group shape of the tiled kernel; by default, or when the shape
+  // does not fit the device, the kernel tries the shapes of 64 to 256
+  // work-items on one x plane and keeps the fastest for the device.
+  void setWorkGroup(WorkGroup wg) { workGroup = wg; }
+  static constexpr int tiledPoints = 4;
+  static constexpr int tiledOrbitals = 8;
+  // Host threads of the native kernel; 0, the default, uses every hardware
+  // thread.
+  void setThreads(int n) { threads = n; }
+  // eight doubles fill an AVX-512 register, or two AVX2 ones
+  static constexpr int nativeLanes = 8;
+  bool useDensityMatrix();
 
   void spherical(std::string fname);
 
   void dumpXYZ(std::string filename);
 
-//  void dumpCube(double, double, double, double, int, int, int, vector<double>,
-//                std::string filename);
-  void dumpCube(double xmin, double ymin, double zmin, double delta,
-                       int nx, int ny, int nz, vector<double> field,
-                       std::string filename) {
-    std::ofstream fout(filename);
-    if (fout.is_open()) {
-
-      fout << "Density" << std::endl;
-      fout << "By handleWF project" << std::endl;
-      fout << std::setw(5) << std::fixed << wf.natm;
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << xmin << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << ymin << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << zmin;
-      fout << std::endl;
-
-      fout << std::setw(5) << std::fixed << nx;
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << delta << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0;
-      fout << std::endl;
-
-      fout << std::setw(5) << std::fixed << ny;
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << delta << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0;
-      fout << std::endl;
-
-      fout << std::setw(5) << std::fixed << nz;
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << delta;
-      fout << std::endl;
-    }
-
-    for (auto atom : wf.atoms) {
-      fout << std::setw(5) << std::fixed << atom.get_atnum();
-      fout << std::setw(13) << std::setprecision(6) << std::fixed
-           << atom.get_charge() << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_x()
-           << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_y()
-           << ' ';
-      fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_z();
-      fout << std::endl;
-    }
-
-    int cnt = 0;
-    for (auto value : field) {
-      cnt++;
-      fout << std::setw(15) << std::setprecision(6) << std::fixed
-           << std::scientific << value;
-      if (cnt == 6) {
-        fout << std::endl;
-        cnt = 0;
-      }
-    }
-    if (cnt != 0)
-      fout << std::endl;
-
-    fout.close();
-  }
+  // Write the field through the selected output format, appending the
+  // file extension to name.
+  void dumpField(const double *field, std::string name);
+  void dumpCube(double xmin, double ymin, double zmin, double delta, int nx,
+                int ny, int nz, const double *field, std::string filename);
+  void dumpBinary(double xmin, double ymin, double zmin, double delta, int nx,
+                  int ny, int nz, const double *field, std::string filename);
+
+  // Sparse output of the adaptive kernel (native endianness): the binary
+  // header with magic "HWFOCTRE", then
+  //   int64 nleaves; nleaves x { int32 lo[3], hi[3] }
+  //   int64 npoints; npoints x { int64 index; double value }
+  // with the evaluated points in increasing index of the grid. Every
+  // corner of a leaf is among the points.
+  void dumpOctree(std::string filename);
+
+  void setFormat(Format f) { format = f; }
 
+  // Pieces of the output formats, for writers that assemble a file from
+  // parts of the field (runDistributed). A cube value takes cubeWidth
+  // characters, six to a line; formatCube() formats n values starting at
+  // position first of a field of total values into out, which needs room
+  // for n * (cubeWidth + 1) characters, and returns the length written.
+  static constexpr size_t cubeWidth = 15;
+  static constexpr size_t cubeChunk = size_t(1) << 18;
+  std::string cubeHeader(double xmin, double ymin, double zmin, double delta,
+                         int nx, int ny, int nz);
+  static size_t formatCube(const double *field, size_t n, size_t first,
+                           size_t total, char *out);
+  std::string binaryHeader(double xmin, double ymin, double zmin,
+                           double delta, int nx, int ny, int nz);
+
+  // Restrict the grid to count x planes starting at plane first, before
+  // any evaluation. The kernels then evaluate only that slab of the box.
+  void setSlab(int first, int count);
+
+  // Batch mode: output names get a per-molecule prefix, and with deferred
+  // output the kernels only record the name of the last result, which
+  // writeOutput() writes later, possibly from another thread; it throws
+  // std::runtime_error when a file cannot be opened.
+  void setOutputPrefix(std::string p) { prefix = p; }
+  void setDeferredOutput(bool d) { deferred = d; }
+  void writeOutput();
+  // Free the device copies; the host result stays available.
+  void releaseDevice();
+
+  // Profiling of the last evaluation, in microseconds like Timer: the
+  // device time of its kernels and of its copies between device and host,
+  // taken from the events of the queue. Both are zero unless the queue was
+  // created with enable_profiling; evalDensity_multi uses queues of its
+  // own and records nothing.
+  double kernelTime() const { return eventTime(kernelEvents); }
+  double transferTime() const { return eventTime(transferEvents); }
+  size_t transferBytes() const { return nbytes; }
+  // Nominal floating-point operations per grid point of a kernel, without
+  // screening and with exp counted as one.
+  double flopsPerPoint(const std::string &kernel);
+
+  // Result of the last evaluation, x slowest and z fastest.
+  const std::vector<double> &getField() const { return rho; }
+  // After evalDerivatives(): the x, y and z components of the gradient one
+  // after the other, each laid out as getField(), and the Laplacian.
+  const std::vector<double> &getGradient() const { return grad; }
+  const std::vector<double> &getLaplacian() const { return lap; }
+
+  // Without a host result nothing is written and the SYCL kernels leave the
+  // field on the device only, to be consumed through deviceResult(), e.g.
+  // by Isosurface.
+  void setHostResult(bool h) { hostResult = h; }
+  // Device copy of the last result, same layout as getField(). After the
+  // cpu kernel the host result is uploaded first.
+  const double *deviceResult();
+  sycl::queue &getQueue() { return q; }
+  // Device copy of the wavefunction, uploaded on first use, for other
+  // Fields of the same wavefunction.
+  std::shared_ptr<DeviceWF> deviceWF();
+
+  // Move to the grid from rmin to -rmin with spacing delta. Only the
+  // buffers of the old grid are released: the wavefunction stays on the
+  // device, and the cutoffs and settings are kept.
+  void setGrid(double rmin, double delta);
+
+  // Grid of the field: first point, spacing and points per axis.
+  double getOrigin(int axis) const { return axis == 0 ? xmin : axis == 1 ? ymin : zmin; }
+  double getDelta() const { return delta; }
+  int getPoints(int axis) const {
+    return axis == 0 ? npoints_x : axis == 1 ? npoints_y : npoints_z;
+  }
 
 private:
   Wavefunction &wf;
@@ -102,7 +257,76 @@ private:
   int npoints_y;
   int npoints_z;
   size_t nsize;
+  std::vector<double> rho; // the only field-sized allocation of a run
+  std::vector<double> grad; // ... except for the derivatives
+  std::vector<double> lap;
+
+  // Device side: one queue and one upload of the wavefunction, reused by
+  // every evaluation on this grid.
+  sycl::queue q;
+  std::shared_ptr<DeviceWF> dwf;
+  // copies of the wavefunction for the devices of evalDensity_multi
+  std::vector<std::unique_ptr<DeviceWF>> mdwf;
+  static std::vector<sycl::queue> &deviceQueues();
+  double *d_rho;
+  float *d_srho; // result of the all-float kernels
+  double *d_scratch;
+  size_t nscratch;
+  bool onDevice; // d_rho holds the last result
+  bool hostResult;
+
+  std::vector<sycl::event> kernelEvents;
+  std::vector<sycl::event> transferEvents;
+  size_t nbytes;
+  double eventTime(const std::vector<sycl::event> &events) const;
+  void recordTransfer(sycl::event e, size_t bytes) {
+    transferEvents.push_back(e);
+    nbytes += bytes;
+  }
+
+  DeviceWF &device();
+  double *deviceField();
+  // Output of a kernel accumulating in Acc: the device field for double; for
+  // float a float buffer that fetchOutput() widens on the host, so that the
+  // all-float kernels do no double arithmetic on the device.
+  template <class Acc> Acc *deviceOutput();
+  template <class Acc> void fetchOutput();
+  double *deviceScratch(size_t n);
+  void fetchResult();
+  void setGrid();
+  void setPoints();
+
+  double tol;
+  unsigned cutoffRevision; // wf.revision the cutoffs were computed for
+  void checkOrder();
+  std::vector<double> cut2;  // squared cutoff radius per primitive
+  std::vector<double> bcut2; // largest cutoff of each block of primitives
+  std::vector<double> dcut2;  // the same for the gradient and Laplacian
+  std::vector<double> dbcut2;
+
+  Strategy strategy;
+  Precision precision;
+  Format format;
+  template <class Real, class Acc> void evalSycl2();
+
+  WorkGroup workGroup;
+  template <class Real, class Acc> void evalTiled();
+  template <class Real, class Acc> WorkGroup tiledShape();
+  template <class Real, class Acc>
+  sycl::event launchTiled(WorkGroup wg, int nx);
+
+  int threads;
+
+  double rhoRefine;
+  double gradRefine;
+  std::vector<OctreeCell> leaves; // of the last adaptive evaluation
+  std::vector<size_t> evaluated;  // grid points evaluated by it, sorted
+  bool refineCell(const OctreeCell &c);
 
+  std::string prefix;
+  std::string outname;
+  bool deferred;
+  void writeField(const double *field, std::string name);
 };
 
 
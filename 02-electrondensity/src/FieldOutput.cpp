@@ -0,0 +1,212 @@
+#include "Field.hpp"
+#include "Atom.hpp"
+#include "WaveFunction.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+void Field::dumpField(const double *field, std::string name) {
+  outname = prefix + name;
+  if (!hostResult)
+    outname.clear();
+  else if (!deferred) {
+    try {
+      writeField(field, outname);
+    } catch (const std::runtime_error &e) {
+      std::cerr << " " << e.what() << std::endl;
+    }
+  }
+}
+
+// Deferred output always refers to rho, where every kernel leaves its
+// result.
+void Field::writeOutput() {
+  if (!outname.empty())
+    writeField(rho.data(), outname);
+}
+
+void Field::writeField(const double *field, std::string name) {
+  if (format == Format::Binary)
+    dumpBinary(xmin, ymin, zmin, delta, npoints_x, npoints_y, npoints_z, field,
+               name + ".bin");
+  else
+    dumpCube(xmin, ymin, zmin, delta, npoints_x, npoints_y, npoints_z, field,
+             name + ".cube");
+  if (!leaves.empty())
+    dumpOctree(name + ".oct");
+  // derivatives of evalDerivatives(), always with the field
+  if (!lap.empty() && field == rho.data()) {
+    const char *comp[3] = {"_gradx", "_grady", "_gradz"};
+    for (int c = 0; c < 3; c++)
+      writeField(grad.data() + c * nsize, name + comp[c]);
+    writeField(lap.data(), name + "_lap");
+  }
+}
+
+void Field::dumpCube(double xmin, double ymin, double zmin, double delta,
+                     int nx, int ny, int nz, const double *field,
+                     std::string filename) {
+  std::ofstream fout(filename, std::ios::binary);
+  if (!fout.is_open())
+    throw std::runtime_error("Error to open file " + filename);
+
+  fout << cubeHeader(xmin, ymin, zmin, delta, nx, ny, nz);
+
+  // The values are formatted into a large buffer and written out in big
+  // chunks.
+  const size_t n = size_t(nx) * ny * nz;
+  std::vector<char> buffer(cubeChunk * (cubeWidth + 1));
+  for (size_t first = 0; first < n; first += cubeChunk) {
+    const size_t len = formatCube(field + first, std::min(cubeChunk, n - first),
+                                  first, n, buffer.data());
+    fout.write(buffer.data(), len);
+  }
+
+  fout.close();
+}
+
+std::string Field::cubeHeader(double xmin, double ymin, double zmin,
+                              double delta, int nx, int ny, int nz) {
+  std::ostringstream fout;
+  fout << "Density" << std::endl;
+  fout << "By handleWF project" << std::endl;
+  fout << std::setw(5) << std::fixed << wf.natm;
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << xmin << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << ymin << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << zmin;
+  fout << std::endl;
+
+  fout << std::setw(5) << std::fixed << nx;
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << delta << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0;
+  fout << std::endl;
+
+  fout << std::setw(5) << std::fixed << ny;
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << delta << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0;
+  fout << std::endl;
+
+  fout << std::setw(5) << std::fixed << nz;
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << 0.0 << ' ';
+  fout << std::setw(13) << std::setprecision(6) << std::fixed << delta;
+  fout << std::endl;
+
+  for (auto atom : wf.atoms) {
+    fout << std::setw(5) << std::fixed << atom.get_atnum();
+    fout << std::setw(13) << std::setprecision(6) << std::fixed
+         << atom.get_charge() << ' ';
+    fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_x()
+         << ' ';
+    fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_y()
+         << ' ';
+    fout << std::setw(13) << std::setprecision(6) << std::fixed << atom.get_z();
+    fout << std::endl;
+  }
+  return fout.str();
+}
+
+// Values are formatted with to_chars, six per line as "%15.6e" (or iostream
+// std::scientific in a width of 15) would print them, with a lowercase e
+// like the original output; it is not "%E". Lines run on through the whole field, so the line breaks follow the
+// position in the field, not in the piece being formatted.
+size_t Field::formatCube(const double *field, size_t n, size_t first,
+                         size_t total, char *out) {
+  size_t pos = 0;
+  for (size_t i = 0; i < n; i++) {
+    char num[32];
+    auto res = std::to_chars(num, num + sizeof(num), field[i],
+                             std::chars_format::scientific, 6);
+    const size_t len = res.ptr - num;
+    for (size_t pad = len; pad < cubeWidth; pad++)
+      out[pos++] = ' ';
+    std::memcpy(&out[pos], num, len);
+    pos += len;
+
+    const size_t g = first + i + 1;
+    if (g % 6 == 0 || g == total)
+      out[pos++] = '\n';
+  }
+  return pos;
+}
+
+// Raw binary layout (native endianness):
+//   char[8]  "HWFFIELD"
+//   int32    natm, nx, ny, nz
+//   double   xmin, ymin, zmin, delta
+//   natm x { int32 Z; double charge, x, y, z }
+//   double   field[nx][ny][nz]
+std::string Field::binaryHeader(double xmin, double ymin, double zmin,
+                                double delta, int nx, int ny, int nz) {
+  std::string header("HWFFIELD");
+  auto put = [&header](const auto &value) {
+    header.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+
+  put(int32_t(wf.natm));
+  put(int32_t(nx));
+  put(int32_t(ny));
+  put(int32_t(nz));
+  put(xmin);
+  put(ymin);
+  put(zmin);
+  put(delta);
+
+  for (auto atom : wf.atoms) {
+    put(int32_t(atom.get_atnum()));
+    put(atom.get_charge());
+    put(atom.get_x());
+    put(atom.get_y());
+    put(atom.get_z());
+  }
+  return header;
+}
+
+void Field::dumpBinary(double xmin, double ymin, double zmin, double delta,
+                       int nx, int ny, int nz, const double *field,
+                       std::string filename) {
+  std::ofstream fout(filename, std::ios::binary);
+  if (!fout.is_open())
+    throw std::runtime_error("Error to open file " + filename);
+
+  fout << binaryHeader(xmin, ymin, zmin, delta, nx, ny, nz);
+  fout.write(reinterpret_cast<const char *>(field),
+             sizeof(double) * size_t(nx) * ny * nz);
+  fout.close();
+}
+
+void Field::dumpOctree(std::string filename) {
+  std::ofstream fout(filename, std::ios::binary);
+  if (!fout.is_open())
+    throw std::runtime_error("Error to open file " + filename);
+
+  auto put = [&fout](const auto &value) {
+    fout.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  };
+
+  std::string header = binaryHeader(xmin, ymin, zmin, delta, npoints_x,
+                                    npoints_y, npoints_z);
+  header.replace(0, 8, "HWFOCTRE");
+  fout << header;
+
+  put(int64_t(leaves.size()));
+  for (const auto &c : leaves)
+    for (int v : {c.lo[0], c.lo[1], c.lo[2], c.hi[0], c.hi[1], c.hi[2]})
+      put(int32_t(v));
+
+  put(int64_t(evaluated.size()));
+  for (size_t p : evaluated) {
+    put(int64_t(p));
+    put(rho[p]);
+  }
+  fout.close();
+}
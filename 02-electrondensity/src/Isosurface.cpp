@@ -0,0 +1,158 @@
+#include "Isosurface.hpp"
+#include "marchingCubes_kernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+// Device arrays only grow, by at least half their size, so a sweep reuses
+// them after the first few isovalues.
+size_t grown(size_t capacity, size_t n) {
+  return std::max(n, capacity + capacity / 2);
+}
+
+template <class T> void reallocate(sycl::queue &q, T *&ptr, size_t n) {
+  sycl::free(ptr, q);
+  ptr = sycl::malloc_device<T>(n, q);
+}
+
+} // namespace
+
+Isosurface::Isosurface(Field &field)
+    : field(field), q(field.getQueue()),
+      gridSize(field.getPoints(2), field.getPoints(1), field.getPoints(0)),
+      voxelSize(static_cast<float>(field.getDelta())), d_voxelVertsScan(nullptr),
+      d_compVoxelArray(nullptr), d_compCubeIndex(nullptr),
+      d_candidateSlot(nullptr), d_vertexBase(nullptr), voxelCapacity(0),
+      pos(nullptr), normal(nullptr), index(nullptr), vertCapacity(0),
+      indexCapacity(0), nverts(0), nindices(0) {
+  allocateTextures(q, &d_edgeTable, &d_triTable, &d_numVertsTable);
+  d_totals = sycl::malloc_device<unsigned>(3, q);
+  allocateBrickState(q, gridSize);
+}
+
+Isosurface::~Isosurface() {
+  q.wait();
+  destroyBrickState(q);
+  destroyScanState(q);
+  for (unsigned *ptr : {d_edgeTable, d_triTable, d_numVertsTable, d_totals,
+                        d_voxelVertsScan, d_compVoxelArray, d_candidateSlot,
+                        d_vertexBase, index})
+    sycl::free(ptr, q);
+  sycl::free(d_compCubeIndex, q);
+  sycl::free(pos, q);
+  sycl::free(normal, q);
+}
+
+void Isosurface::reserveVoxels(size_t n) {
+  allocateScanState(q, n, 1);
+  if (n <= voxelCapacity)
+    return;
+  q.wait();
+  voxelCapacity = grown(voxelCapacity, n);
+  reallocate(q, d_voxelVertsScan, voxelCapacity);
+  reallocate(q, d_compVoxelArray, voxelCapacity);
+  reallocate(q, d_compCubeIndex, voxelCapacity);
+  reallocate(q, d_candidateSlot, voxelCapacity);
+  reallocate(q, d_vertexBase, voxelCapacity);
+}
+
+void Isosurface::reserveMesh(size_t verts, size_t indices) {
+  if (verts > vertCapacity) {
+    q.wait();
+    vertCapacity = grown(vertCapacity, verts);
+    reallocate(q, pos, vertCapacity);
+    reallocate(q, normal, vertCapacity);
+  }
+  if (indices > indexCapacity) {
+    q.wait();
+    indexCapacity = grown(indexCapacity, indices);
+    reallocate(q, index, indexCapacity);
+  }
+}
+
+// Sparse, indexed extraction: only the voxels of the bricks of 8^3 points
+// whose range holds iso are classified, and every vertex is stored once.
+size_t Isosurface::extract(double iso) {
+  const double *volume = field.deviceResult();
+  const float isoValue = static_cast<float>(iso);
+  nverts = nindices = 0;
+
+  const unsigned activeBricks =
+      launch_findActiveBricks(q, {}, volume, gridSize, isoValue);
+  if (activeBricks == 0)
+    return 0;
+
+  const unsigned numCandidates = activeBricks * BRICK_VOXELS;
+  reserveVoxels(numCandidates);
+  launch_classifyCompactVoxels(q, {}, d_compVoxelArray, d_compCubeIndex,
+                               d_voxelVertsScan, d_candidateSlot, d_totals,
+                               volume, d_numVertsTable, d_brickList, gridSize,
+                               numCandidates, isoValue);
+  unsigned totals[3];
+  q.memcpy(totals, d_totals, 2 * sizeof(unsigned)).wait();
+  const unsigned activeVoxels = totals[0];
+  if (activeVoxels == 0)
+    return 0;
+
+  launch_scanMeshVertices(q, d_vertexBase, d_totals, d_compVoxelArray,
+                          d_compCubeIndex, d_edgeTable, gridSize,
+                          activeVoxels);
+  q.memcpy(totals + 2, d_totals + 2, sizeof(unsigned)).wait();
+  nindices = totals[1];
+  nverts = totals[2];
+
+  reserveMesh(nverts, nindices);
+  launch_generateIndexedTriangles(
+      q, pos, normal, index, d_compVoxelArray, d_compCubeIndex,
+      d_voxelVertsScan, d_vertexBase, d_candidateSlot, true, volume,
+      d_triTable, d_numVertsTable, d_edgeTable, gridSize, voxelSize, isoValue,
+      activeVoxels)
+      .wait();
+  return nindices / 3;
+}
+
+// The kernels place grid point (k, j, i) at -1 + (k, j, i) * delta. Back in
+// the axes of the field the mesh is mirrored, so every triangle is written
+// in reverse to keep its winding with respect to the normals.
+void Isosurface::writeOBJ(const std::string &filename) {
+  std::vector<sycl::float4> hpos(nverts), hnormal(nverts);
+  std::vector<unsigned> hindex(nindices);
+  q.memcpy(hpos.data(), pos, nverts * sizeof(sycl::float4));
+  q.memcpy(hnormal.data(), normal, nverts * sizeof(sycl::float4));
+  q.memcpy(hindex.data(), index, nindices * sizeof(unsigned));
+  q.wait();
+
+  std::ofstream fout(filename);
+  if (!fout.is_open()) {
+    std::cerr << " Error to open file " << filename << std::endl;
+    return;
+  }
+
+  const double x0 = field.getOrigin(0) + 1.0;
+  const double y0 = field.getOrigin(1) + 1.0;
+  const double z0 = field.getOrigin(2) + 1.0;
+  fout << "# isosurface by handleWF project" << std::endl;
+  fout << std::setprecision(6) << std::fixed;
+  for (const auto &p : hpos)
+    fout << "v " << x0 + p.z() << ' ' << y0 + p.y() << ' ' << z0 + p.x()
+         << '\n';
+  for (const auto &n : hnormal) {
+    const double len = std::sqrt(n.x() * n.x() + n.y() * n.y() + n.z() * n.z());
+    const double s = len > 0.0 ? 1.0 / len : 0.0;
+    fout << "vn " << n.z() * s << ' ' << n.y() * s << ' ' << n.x() * s
+         << '\n';
+  }
+  for (size_t t = 0; t + 2 < nindices; t += 3) {
+    const unsigned a = hindex[t] + 1, b = hindex[t + 1] + 1,
+                   c = hindex[t + 2] + 1;
+    fout << "f " << a << "//" << a << ' ' << c << "//" << c << ' ' << b
+         << "//" << b << '\n';
+  }
+  fout.close();
+}
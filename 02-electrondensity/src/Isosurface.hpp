@@ -0,0 +1,75 @@
+#ifndef _ISOSURFACE_HPP_
+#define _ISOSURFACE_HPP_
+
+#include "Field.hpp"
+#include <string>
+#include <sycl/sycl.hpp>
+
+// Isosurfaces of an evaluated field, extracted by the SYCL marching cubes
+// kernels of 03-marchingCubes straight from the device copy of the field,
+// with no file or quantization in between. The buffers are kept from one
+// extraction to the next, so a sweep over isovalues only runs the kernels.
+//
+// The kernels keep their scan and brick state in globals, so only one
+// Isosurface may be alive at a time.
+class Isosurface {
+public:
+  explicit Isosurface(Field &field);
+  ~Isosurface();
+  Isosurface(const Isosurface &) = delete;
+  Isosurface &operator=(const Isosurface &) = delete;
+
+  // Extract the surface where the last result of the field equals iso and
+  // return its number of triangles.
+  size_t extract(double iso);
+
+  // Mesh of the last extraction in device memory, valid until the next one:
+  // every vertex once with its normal, three indices per triangle. The
+  // coordinates are those of the kernels, see writeOBJ().
+  const sycl::float4 *devicePositions() const { return pos; }
+  const sycl::float4 *deviceNormals() const { return normal; }
+  const unsigned *deviceIndices() const { return index; }
+  size_t getVertexCount() const { return nverts; }
+  size_t getTriangleCount() const { return nindices / 3; }
+
+  // Download the last mesh and write it as Wavefront OBJ in the coordinates
+  // of the field. As in the marching cubes sample, the last layer of voxels
+  // repeats the border points, so a surface cut by the grid border reaches
+  // up to one spacing past the last point.
+  void writeOBJ(const std::string &filename);
+
+private:
+  Field &field;
+  sycl::queue &q;
+  // The kernels index volumes x fastest, the field has z fastest: the grid
+  // is handed over as (nz, ny, nx) and the axes swapped back on output.
+  sycl::uint3 gridSize;
+  sycl::float3 voxelSize;
+
+  // look-up tables and the per-extraction totals
+  unsigned *d_edgeTable;
+  unsigned *d_triTable;
+  unsigned *d_numVertsTable;
+  unsigned *d_totals;
+
+  // compacted voxels of the active bricks, grown as needed
+  unsigned *d_voxelVertsScan;
+  unsigned *d_compVoxelArray;
+  unsigned char *d_compCubeIndex;
+  unsigned *d_candidateSlot;
+  unsigned *d_vertexBase;
+  size_t voxelCapacity;
+
+  sycl::float4 *pos;
+  sycl::float4 *normal;
+  unsigned *index;
+  size_t vertCapacity;
+  size_t indexCapacity;
+  size_t nverts;
+  size_t nindices;
+
+  void reserveVoxels(size_t n);
+  void reserveMesh(size_t verts, size_t indices);
+};
+
+#endif
@@ -1,92 +1,235 @@
 #include "WaveFunction.hpp"
 
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 Wavefunction::Wavefunction() {
   natm = 0;
   norb = 0;
   npri = 0;
+  revision = 0;
 }
 
 Wavefunction::~Wavefunction() {}
 
-void Wavefunction::loadWF(string fname) {
-  int itmp;
-  double tmp;
-  double tx, ty, tz;
-  std::vector<int> atomicNumbers;
-  std::vector<Rvector> atomicCoordinates;
-
-  std::ifstream file(fname);
-  if (file.is_open()) {
-    file.clear();
-    file.seekg(0, std::ios::beg);
-    std::string line;
-    while (std::getline(file, line)) {
-      if (line.find("<Number of Occupied Molecular Orbitals>") !=
-          std::string::npos) {
-        std::getline(file, line);
-        norb = std::stoi(line);
-      }
-      if (line.find("<Number of Primitives>") != std::string::npos) {
-        std::getline(file, line);
-        npri = std::stoi(line);
-      }
-      if (line.find("<Primitive Centers>") != std::string::npos) {
-        readVector(file, icntrs, "</Primitive Centers>");
-        for (auto &i : icntrs)
-          i -= 1;
-      }
-      if (line.find("<Primitive Types>") != std::string::npos) {
-        readVector(file, itypes, "</Primitive Types>");
-      }
-      if (line.find("<Primitive Exponents>") != std::string::npos) {
-        readVector(file, depris, "</Primitive Exponents>");
-      }
-      if (line.find("<Molecular Orbital Occupation Numbers>") !=
-          std::string::npos) {
-        readVector(file, dnoccs, "</Molecular Orbital Occupation Numbers>");
-      }
-      if (line.find("<MO Number>") != std::string::npos) {
-        std::getline(file, line);
-        std::getline(file, line);
-
-        if (line.find("</MO Number>") != std::string::npos) {
-          for (int j = 0; j < npri; j++) {
-            file >> tmp;
-            dcoefs.push_back(tmp);
-          }
-        }
-      }
-      if (line.find(string("<Number of Nuclei>")) != std::string::npos) {
-        std::getline(file, line);
-        natm = std::stoi(line);
-      }
-      if (line.find(string("<Nuclear Cartesian Coordinates>")) !=
-          std::string::npos) {
-        for (int i = 0; i < natm; i++) {
-          std::getline(file, line);
-          sscanf(line.c_str(), "%lf %lf %lf", &tx, &ty, &tz);
-          atomicCoordinates.push_back(Rvector(tx, ty, tz));
-        }
-      }
-      if (line.find(string("<Atomic Numbers>")) != std::string::npos) {
-        for (int i = 0; i < natm; i++) {
-          getline(file, line);
-          sscanf(line.c_str(), "%d", &itmp);
-          atomicNumbers.push_back(itmp);
-        }
+namespace {
+
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0)
+      return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        data = static_cast<const char *>(map);
+        size = st.st_size;
+        madvise(map, size, MADV_SEQUENTIAL);
       }
     }
-    setAngularVector();
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data)
+      munmap(const_cast<char *>(data), size);
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
 
-    for (int i = 0; i < natm; i++)
-      addAtom(Atom(atomicNumbers[i], atomicCoordinates[i]));
-    file.close();
-  } else {
-    std::cerr << " Error to open file " << fname << std::endl;
+  const char *data = nullptr;
+  size_t size = 0;
+};
+
+const char *skipSpace(const char *p, const char *end) {
+  while (p < end && std::isspace(static_cast<unsigned char>(*p)))
+    p++;
+  return p;
+}
+
+// Start of the next tag, or end.
+const char *nextTag(const char *p, const char *end) {
+  const void *q = std::memchr(p, '<', end - p);
+  return q ? static_cast<const char *>(q) : end;
+}
+
+template <typename T>
+const char *parseValue(const char *p, const char *end, T &value,
+                       std::string_view what) {
+  p = skipSpace(p, end);
+  if (p < end && *p == '+') // from_chars does not take a leading +
+    p++;
+  auto res = std::from_chars(p, end, value);
+  if (res.ec != std::errc())
+    throw std::runtime_error("Error reading " + std::string(what));
+  return res.ptr;
+}
+
+// Exactly n values into out.
+template <typename T>
+const char *parseValues(const char *p, const char *end, T *out, size_t n,
+                        std::string_view what) {
+  for (size_t i = 0; i < n; i++)
+    p = parseValue(p, end, out[i], what);
+  return p;
+}
+
+// Every value up to the closing tag of the section.
+template <typename T>
+const char *parseSection(const char *p, const char *end, std::vector<T> &out,
+                         size_t expected, std::string_view what) {
+  out.clear();
+  out.reserve(expected);
+  for (p = skipSpace(p, end); p < end && *p != '<'; p = skipSpace(p, end)) {
+    T value;
+    p = parseValue(p, end, value, what);
+    out.push_back(value);
+  }
+  return p;
+}
+
+} // namespace
+
+// Single pass over the mapped file, dispatching on the tag names. The MO
+// coefficient blocks are only located during the pass and parsed afterwards
+// straight into dcoefs, in parallel when there are many of them.
+void Wavefunction::readWF(string fname) {
+  MappedFile file(fname);
+  if (!file.data)
+    throw std::runtime_error("Error to open file " + fname);
+
+  revision++;
+  const char *p = file.data;
+  const char *end = file.data + file.size;
+  std::vector<int> atomicNumbers;
+  std::vector<double> atomicCoordinates;
+  std::vector<const char *> moBlocks;
+
+  while ((p = nextTag(p, end)) < end) {
+    const char *close =
+        static_cast<const char *>(std::memchr(p, '>', end - p));
+    if (!close)
+      break;
+    std::string_view tag(p + 1, close - p - 1);
+    p = close + 1;
+
+    if (tag == "Number of Occupied Molecular Orbitals")
+      p = parseValue(p, end, norb, tag);
+    else if (tag == "Number of Primitives")
+      p = parseValue(p, end, npri, tag);
+    else if (tag == "Number of Nuclei")
+      p = parseValue(p, end, natm, tag);
+    else if (tag == "Primitive Centers") {
+      p = parseSection(p, end, icntrs, npri, tag);
+      for (auto &i : icntrs)
+        i -= 1;
+    } else if (tag == "Primitive Types")
+      p = parseSection(p, end, itypes, npri, tag);
+    else if (tag == "Primitive Exponents")
+      p = parseSection(p, end, depris, npri, tag);
+    else if (tag == "Molecular Orbital Occupation Numbers")
+      p = parseSection(p, end, dnoccs, norb, tag);
+    else if (tag == "Nuclear Cartesian Coordinates") {
+      atomicCoordinates.resize(3 * natm);
+      p = parseValues(p, end, atomicCoordinates.data(), 3 * natm, tag);
+    } else if (tag == "Atomic Numbers") {
+      atomicNumbers.resize(natm);
+      p = parseValues(p, end, atomicNumbers.data(), natm, tag);
+    } else if (tag == "/MO Number")
+      moBlocks.push_back(p);
+  }
+
+  const size_t nmo = moBlocks.size();
+  dcoefs.resize(nmo * npri);
+  auto parseBlocks = [&](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++)
+      parseValues(moBlocks[i], end, &dcoefs[i * npri], npri,
+                  "MO coefficients");
+  };
+  const size_t nthreads =
+      std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                       dcoefs.size() / (size_t(1) << 16) + 1);
+  if (nthreads > 1 && nmo > 1) {
+    std::vector<std::future<void>> parts;
+    const size_t chunk = (nmo + nthreads - 1) / nthreads;
+    for (size_t first = 0; first < nmo; first += chunk)
+      parts.push_back(std::async(std::launch::async, parseBlocks, first,
+                                 std::min(first + chunk, nmo)));
+    for (auto &part : parts)
+      part.get();
+  } else
+    parseBlocks(0, nmo);
+
+  setAngularVector();
+  setBlocks();
+
+  for (int i = 0; i < natm; i++)
+    addAtom(Atom(atomicNumbers[i],
+                 Rvector(atomicCoordinates[3 * i], atomicCoordinates[3 * i + 1],
+                         atomicCoordinates[3 * i + 2])));
+}
+
+void Wavefunction::loadWF(string fname) {
+  try {
+    readWF(fname);
+  } catch (const std::runtime_error &e) {
+    std::cerr << " " << e.what() << std::endl;
     exit(EXIT_FAILURE);
   }
 }
 
+void Wavefunction::sortPrimitives() {
+  std::vector<int> perm(npri);
+  for (int j = 0; j < npri; j++)
+    perm[j] = j;
+  std::stable_sort(perm.begin(), perm.end(), [&](int a, int b) {
+    if (icntrs[a] != icntrs[b])
+      return icntrs[a] < icntrs[b];
+    return itypes[a] < itypes[b];
+  });
+
+  std::vector<int> icnt_s(npri), ityp_s(npri);
+  std::vector<double> depr_s(npri), coef_s(dcoefs.size());
+  for (int j = 0; j < npri; j++) {
+    icnt_s[j] = icntrs[perm[j]];
+    ityp_s[j] = itypes[perm[j]];
+    depr_s[j] = depris[perm[j]];
+  }
+  for (int i = 0; i < norb; i++)
+    for (int j = 0; j < npri; j++)
+      coef_s[i * npri + j] = dcoefs[i * npri + perm[j]];
+
+  icntrs.swap(icnt_s);
+  itypes.swap(ityp_s);
+  depris.swap(depr_s);
+  dcoefs.swap(coef_s);
+  dmat.clear();
+  revision++;
+
+  setAngularVector();
+  setBlocks();
+}
+
+void Wavefunction::setBlocks() {
+  iblocks.clear();
+  for (int j = 0; j < npri; j++)
+    if (j == 0 || icntrs[j] != icntrs[j - 1])
+      iblocks.push_back(j);
+  iblocks.push_back(npri);
+}
+
 void Wavefunction::setAngularVector() {
   int j;
   vang.resize(3 * npri);
@@ -374,26 +517,30 @@ void Wavefunction::setAngularVector() {
       break;
 
     default:
-      printf(" Type of primitive unsupported!!\n");
-      exit(EXIT_FAILURE);
-      break;
+      throw std::runtime_error("Type of primitive unsupported!!");
     } // Fin del switch
   }   // Fin del for
 }
 
 void Wavefunction::addAtom(Atom a) { atoms.push_back(a); }
 
-template <typename T>
-void Wavefunction::readVector(std::ifstream &file, std::vector<T> &vector,
-                              std::string endblock) {
-  std::string line;
-  while (std::getline(file, line) && line != endblock) {
-    std::istringstream iss(line);
-    T value;
-    while (iss >> value) {
-      vector.push_back(value);
+void Wavefunction::buildDensityMatrix() {
+  dmat.assign(size_t(npri) * npri, 0.0);
+
+  for (int i = 0; i < norb; i++) {
+    const double *c = &dcoefs[size_t(i) * npri];
+    for (int j = 0; j < npri; j++) {
+      const double ncj = dnoccs[i] * c[j];
+      if (ncj == 0.0)
+        continue;
+      for (int k = j; k < npri; k++)
+        dmat[size_t(j) * npri + k] += ncj * c[k];
     }
   }
+
+  for (int j = 0; j < npri; j++)
+    for (int k = 0; k < j; k++)
+      dmat[size_t(j) * npri + k] = dmat[size_t(k) * npri + j];
 }
 
 void Wavefunction::setIntegerOutput() {
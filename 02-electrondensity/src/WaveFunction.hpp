@@ -2,6 +2,7 @@
 #define _WAVEFUNCTION_HPP
 
 #include "Atom.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
@@ -17,7 +18,13 @@ class Wavefunction {
 public:
   Wavefunction();
   ~Wavefunction();
+  // Exits with a message on a missing or malformed file; readWF() throws
+  // std::runtime_error instead, for loads on other threads.
   void loadWF(string);
+  void readWF(string);
+  // Regroup the primitives by center and type; the coefficient columns are
+  // permuted accordingly, so the density is unchanged.
+  void sortPrimitives();
   // friend ostream &operator<<(ostream &o, const Wavefunction &);
   void printWF();
 
@@ -25,17 +32,21 @@ private:
   int natm;
   int norb;
   int npri;
+  // Bumped whenever the primitives are (re)ordered, so that a Field can
+  // tell its per-primitive cutoffs and device copy from stale ones.
+  unsigned revision;
   std::vector<int> icntrs;
   std::vector<int> itypes;
   std::vector<int> vang;
+  std::vector<int> iblocks; // offsets of the runs of primitives per center
   std::vector<double> depris;
   std::vector<double> dnoccs;
   std::vector<double> dcoefs;
+  std::vector<double> dmat; // primitive density matrix, npri x npri
   std::vector<Atom> atoms;
 
-  template <typename T>
-  void readVector(std::ifstream &file, std::vector<T> &vector,
-                  std::string endblock);
+  // P = C^T diag(nocc) C, so that rho(r) = phi(r)^T P phi(r).
+  void buildDensityMatrix();
 
   template <typename T> void printVector(const std::vector<T> &vector);
 
@@ -43,10 +54,12 @@ private:
 
   void addAtom(Atom a);
   void setAngularVector();
+  void setBlocks();
   void setScientificOutput();
   void setIntegerOutput();
 
   friend class Field;
+  friend class DeviceWF;
 };
 
 #endif
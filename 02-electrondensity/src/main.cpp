@@ -1,8 +1,60 @@
+#include "Batch.hpp"
+#include "Distributed.hpp"
 #include "Field.hpp"
+#include "Isosurface.hpp"
 #include "WaveFunction.hpp"
 #include "version.hpp"
 #include "Timer.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+
+namespace {
+
+// Error of a reduced precision result against the double precision one,
+// also counted in the digits written to a cube file.
+void reportError(const std::vector<double> &value,
+                 const std::vector<double> &ref) {
+  double maxAbs = 0.0, maxRel = 0.0;
+  size_t differ = 0;
+  for (size_t p = 0; p < ref.size(); p++) {
+    const double err = std::fabs(value[p] - ref[p]);
+    maxAbs = std::max(maxAbs, err);
+    if (ref[p] >= 1.e-8)
+      maxRel = std::max(maxRel, err / ref[p]);
+
+    char a[32], b[32];
+    auto ea = std::to_chars(a, a + sizeof(a), value[p],
+                            std::chars_format::scientific, 6);
+    auto eb = std::to_chars(b, b + sizeof(b), ref[p],
+                            std::chars_format::scientific, 6);
+    if (ea.ptr - a != eb.ptr - b || std::memcmp(a, b, ea.ptr - a) != 0)
+      differ++;
+  }
+  std::cout << " Error against double : max abs " << maxAbs
+            << ", max rel " << maxRel << " (density >= 1e-8), "
+            << differ << " of " << ref.size() << " cube values differ"
+            << std::endl;
+}
+
+// A whole option value as a number; false on anything else.
+template <typename T> bool parseNumber(const std::string &s, T &value) {
+  const auto res = std::from_chars(s.data(), s.data() + s.size(), value);
+  return !s.empty() && res.ec == std::errc() && res.ptr == s.data() + s.size();
+}
+
+} // namespace
 
 int main(int argc, char *argv[]) {
   std::cout << "Version: " << PROJECT_VER << std::endl;
@@ -11,17 +63,162 @@ int main(int argc, char *argv[]) {
   std::cout << "Git SHA1: " << GIT_SHA1 << std::endl;
 
   Wavefunction wf;
-  if( argc != 4){
+  std::vector<std::string> args;
+  std::string kernel = "auto";
+  std::string batch;
+  // as given, for the file names, and parsed
+  std::vector<std::pair<std::string, double>> isovalues;
+  bool sort = false;
+  bool mpi = false;
+  bool check = false;
+  Precision precision = Precision::Double;
+  std::vector<double> refine;
+  Strategy strategy = Strategy::Auto;
+  Format format = Format::Cube;
+  WorkGroup workGroup = {0, 0};
+  int threads = 0;
+  auto usage = [&]() {
+    std::cout << " ./" << argv[0] << " foo.wfx"  << " rmin" << " delta"
+              << " [tol]" << " [--kernel=auto|cpu|sycl|sycl2|gemm|multi|adaptive|deriv|tiled|native]" << " [--sort]"
+              << " [--strategy=orbital|dm]" << " [--format=cube|bin]"
+              << " [--precision=double|mixed|float [--check]]" << " [--wg=YxZ]" << " [--threads=n]"
+              << " [--iso=v1,v2,...]" << " [--refine=rho[,grad]]"
+#ifdef USE_MPI
+              << " [--mpi]"
+#endif
+              << std::endl;
+    std::cout << " ./" << argv[0] << " --batch=list|dir" << " rmin"
+              << " delta" << " [tol]" << " [options]" << std::endl;
+    exit(EXIT_FAILURE);
+  };
+  // A bad option value is reported before anything is loaded or evaluated.
+  auto invalid = [&](const std::string &arg) {
+    std::cerr << " Invalid " << arg << ", try with:" << std::endl;
+    usage();
+  };
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    if (arg.rfind("--kernel=", 0) == 0)
+      kernel = arg.substr(9);
+    else if (arg.rfind("--batch=", 0) == 0)
+      batch = arg.substr(8);
+    else if (arg.rfind("--iso=", 0) == 0) {
+      std::stringstream list(arg.substr(6));
+      std::string value;
+      double level;
+      while (std::getline(list, value, ','))
+        if (!value.empty()) {
+          if (!parseNumber(value, level) || !(level > 0.0))
+            invalid(arg);
+          isovalues.emplace_back(value, level);
+        }
+    } else if (arg.rfind("--refine=", 0) == 0) {
+      std::stringstream list(arg.substr(9));
+      std::string value;
+      double threshold;
+      while (std::getline(list, value, ',')) {
+        if (!parseNumber(value, threshold) || !(threshold > 0.0))
+          invalid(arg);
+        refine.push_back(threshold);
+      }
+      if (refine.empty() || refine.size() > 2)
+        invalid(arg);
+    } else if (arg == "--sort")
+      sort = true;
+#ifdef USE_MPI
+    else if (arg == "--mpi")
+      mpi = true;
+#endif
+    else if (arg == "--strategy=orbital")
+      strategy = Strategy::Orbital;
+    else if (arg == "--strategy=dm")
+      strategy = Strategy::DensityMatrix;
+    else if (arg == "--precision=double")
+      precision = Precision::Double;
+    else if (arg == "--precision=mixed")
+      precision = Precision::Mixed;
+    else if (arg == "--precision=float")
+      precision = Precision::Single;
+    else if (arg == "--check")
+      check = true;
+    else if (arg == "--format=cube")
+      format = Format::Cube;
+    else if (arg == "--format=bin")
+      format = Format::Binary;
+    else if (arg.rfind("--wg=", 0) == 0) {
+      if (sscanf(arg.c_str() + 5, "%dx%d", &workGroup.y, &workGroup.z) != 2 ||
+          workGroup.y < 1 || workGroup.z < 1) {
+        std::cerr << " Invalid " << arg << ", expected --wg=YxZ" << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    } else if (arg.rfind("--threads=", 0) == 0) {
+      if (!parseNumber(arg.substr(10), threads))
+        invalid(arg);
+      threads = std::max(0, threads);
+    } else
+      args.push_back(arg);
+  }
+
+  // In batch mode the molecules come from --batch, not from the first
+  // positional argument.
+  const size_t nfile = batch.empty() ? 1 : 0;
+  if( args.size() != nfile + 2 && args.size() != nfile + 3){
     std::cout << " We need more arguments try with:" << std::endl;
-    std::cout << " ./" << argv[0] << " foo.wfx"  << " delta" << " rmin"<< std::endl;
+    usage();
+  }
+
+  if (mpi && !batch.empty()) {
+    std::cerr << " --mpi runs a single molecule, not a batch" << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  wf.loadWF(argv[1]);
-  double delta = std::stod(argv[2]);
-  double rmin  = std::stod(argv[3]);
+  if (!batch.empty() || mpi) {
+    BatchOptions opt;
+    opt.rmin = std::stod(args[nfile]);
+    opt.delta = std::stod(args[nfile + 1]);
+    opt.tol = (args.size() == nfile + 3) ? std::stod(args[nfile + 2]) : 0.0;
+    opt.kernel = kernel;
+    opt.sort = sort;
+    opt.strategy = strategy;
+    opt.precision = precision;
+    opt.format = format;
+    opt.workGroup = workGroup;
+    opt.threads = threads;
+#ifdef USE_MPI
+    if (mpi) {
+      MPI_Init(&argc, &argv);
+      runDistributed(args[0], opt);
+      MPI_Finalize();
+      exit(EXIT_SUCCESS);
+    }
+#endif
+    runBatch(batchInputs(batch), opt);
+    exit(EXIT_SUCCESS);
+  }
+
+  wf.loadWF(args[0]);
+  if (sort)
+    wf.sortPrimitives();
+  double rmin  = std::stod(args[1]);
+  double delta = std::stod(args[2]);
+  double tol   = (args.size() == 4) ? std::stod(args[3]) : 0.0;
 
-  Field field(wf, delta, rmin);
+  Field field(wf, rmin, delta);
+  field.setStrategy(strategy);
+  field.setPrecision(precision);
+  field.setFormat(format);
+  field.setWorkGroup(workGroup);
+  field.setThreads(threads);
+  if (!refine.empty())
+    field.setRefinement(refine[0], refine.size() > 1 ? refine[1] : refine[0]);
+  if (tol > 0.0) {
+    std::cout << " Screening tolerance : " << tol << std::endl;
+    field.setCutoff(tol);
+  }
+  // Isosurfaces are extracted from the device copy of the field, which is
+  // then neither downloaded nor written.
+  if (!isovalues.empty())
+    field.setHostResult(false);
 
   Timer tcpu, tgpu, tgpu2;
 
@@ -34,8 +231,44 @@ int main(int argc, char *argv[]) {
 //vama  tgpu.stop();
 //vama
   tgpu2.start();
-  field.evalDensity_sycl2();
+  try {
+    if (!field.evalKernel(kernel)) {
+      std::cerr << " Unknown kernel " << kernel << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << " " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
   tgpu2.stop();
+  std::cout << " Time for " << kernel << " : " << tgpu2.getDuration() << " \u03BC"
+            << "s" << std::endl;
+
+  // The reference runs the same kernel in double precision, without output,
+  // on the device copy of the wavefunction already uploaded.
+  if (check && precision != Precision::Double && isovalues.empty()) {
+    Field ref(wf, rmin, delta, field.deviceWF());
+    ref.setStrategy(strategy);
+    if (tol > 0.0)
+      ref.setCutoff(tol);
+    ref.setDeferredOutput(true);
+    ref.evalKernel(kernel);
+    reportError(field.getField(), ref.getField());
+  }
+
+  if (!isovalues.empty()) {
+    Isosurface surface(field);
+    Timer tiso;
+    for (const auto &[value, level] : isovalues) {
+      tiso.start();
+      const size_t ntri = surface.extract(level);
+      tiso.stop();
+      std::cout << " Isosurface " << value << " : " << ntri << " triangles, "
+                << surface.getVertexCount() << " vertices in "
+                << tiso.getDuration() << " \u03BC" << "s" << std::endl;
+      surface.writeOBJ("isosurface_" + value + ".obj");
+    }
+  }
 //vama
 //vama  std::cout << " Time for CPU : " << tcpu.getDuration() << " \u03BC"
 //vama            << "s" << std::endl;
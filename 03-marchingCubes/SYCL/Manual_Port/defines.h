@@ -30,6 +30,7 @@
 
 typedef unsigned int uint;
 typedef unsigned char uchar;
+typedef unsigned short ushort;
 
 // if SAMPLE_VOLUME is 0, an implicit dataset is generated. If 1, a voxelized
 // dataset is loaded from file
@@ -44,6 +45,22 @@ typedef unsigned char uchar;
 // memory size)
 #define NTHREADS 32
 
-#define SKIP_EMPTY_VOXELS 1
+// Voxels per work-group of the fused classify/scan/compact kernel. In brick
+// order (-tiled, -sparse) a work-group classifies an 8 x 8 x SCAN_THREADS/64
+// slab of a brick, so it must be 64, 128, 256 or 512. 256 keeps 8 warps on
+// NVIDIA GPUs and 8 to 16 SIMD32/SIMD16 sub-groups on Intel GPUs.
+#ifndef SCAN_THREADS
+#define SCAN_THREADS 256
+#endif
+
+// Edge length in voxels of the bricks skipped as a whole in sparse mode
+// (-sparse) when the isovalue is outside their range, and of the bricks the
+// tiled classification walks
+#define BRICK_SIZE 8
+#define BRICK_VOXELS (BRICK_SIZE * BRICK_SIZE * BRICK_SIZE)
+
+// Isovalues one multi-level extraction (-levels) classifies together; at
+// most one per work-item of a look-back, so no more than SCAN_THREADS
+#define MAX_ISO_LEVELS 16
 
 #endif
@@ -9,10 +9,9 @@
   Marching cubes
 
   This sample extracts a geometric isosurface from a volume dataset using
-  the marching cubes algorithm. It uses the scan (prefix sum) function from
-  the Thrust library to perform stream compaction.  Similar techniques can
-  be used for other problems that require a variable-sized output per
-  thread.
+  the marching cubes algorithm. It uses a single-pass scan (prefix sum) to
+  perform stream compaction.  Similar techniques can be used for other
+  problems that require a variable-sized output per thread.
 
   For more information on marching cubes see:
   http://local.wasp.uwa.edu.au/~pbourke/geometry/polygonise/
@@ -21,43 +20,68 @@
   Volume data courtesy:
   http://www9.informatik.uni-erlangen.de/External/vollib/
 
-  For more information on the Thrust library
-  http://code.google.com/p/thrust/
-
   The algorithm consists of several stages:
 
-  1. Execute "classifyVoxel" kernel
+  1. Execute the "classifyCompactVoxels" kernel
   This evaluates the volume at the corners of each voxel and computes the
-  number of vertices each voxel will generate.
-  It is executed using one thread per voxel.
-  It writes two arrays - voxelOccupied and voxelVertices to global memory.
-  voxelOccupied is a flag indicating if the voxel is non-empty.
-
-  2. Scan "voxelOccupied" array (using Thrust scan)
-  Read back the total number of occupied voxels from GPU to CPU.
-  This is the sum of the last value of the exclusive scan and the last
-  input value.
-
-  3. Execute "compactVoxels" kernel
-  This compacts the voxelOccupied array to get rid of empty voxels.
-  This allows us to run the complex "generateTriangles" kernel on only
-  the occupied voxels.
-
-  4. Scan voxelVertices array
-  This gives the start address for the vertex data for each voxel.
-  We read back the total number of vertices generated from GPU to CPU.
+  number of vertices each voxel will generate, one work-item per voxel.
+  Occupancy and vertex count of all voxels are scanned together in the
+  same kernel (work-group scan plus decoupled look-back across work-groups),
+  which writes the compacted array of occupied voxels and the start address
+  of each one's vertex data.
+  The totals, active voxels and vertices, are read back in a single copy.
 
-  Note that by using a custom scan function we could combine the above two
-  scan operations above into a single operation.
+  The case (cube index) of every occupied voxel is stored with it.
 
-  5. Execute "generateTriangles" kernel
+  2. Execute "generateTriangles" kernel
   This runs only on the occupied voxels.
-  It looks up the field values again and generates the triangle data,
-  using the results of the scan to write the output to the correct addresses.
-  The marching cubes look-up tables are stored in 1D textures.
+  It reuses the stored case, reads the corner values from the volume and
+  takes the normals from central differences of the volume, then generates
+  the triangle data, using the results of the scan to write the output to
+  the correct addresses.
 
-  6. Render geometry
+  3. Render geometry
   Using number of vertices from readback.
+
+  Grids of any size (-size=<x>x<y>x<z>) are supported, and volumes of
+  uint8, uint16 or float voxels (-type); integer voxels are normalized to
+  [0, 1] before comparing with the isovalue (-iso).
+
+  With -sparse, stage 1 is preceded by a pass over bricks of 8^3 voxels
+  that keeps only the bricks whose value range contains the isovalue. Just
+  their voxels are classified, and the scan and compacted arrays are sized
+  to them instead of to the whole grid. The compacted voxels are then in
+  brick order rather than index order.
+
+  Brick order, which -tiled also selects for the whole grid, classifies
+  each work-group's voxels from a tile of the volume in local memory
+  instead of fetching every sample from global memory for each of the 8
+  voxels sharing it.
+
+  With -levels=<v1,v2,...> (or -nlevels=<n>, isovalues -iso + k * -diso),
+  up to MAX_ISO_LEVELS isovalues are extracted in one pass. Stage 1 reads
+  the corners of each voxel once, classifies them against every level and
+  scans each level separately, compacting one entry per occupied voxel and
+  level. One launch of stage 2 then writes all meshes, one after the other
+  in level order.
+
+  With -indexed, stage 2 writes every vertex once and the triangles as
+  indices into them. Each vertex is stored by the voxel its edge starts
+  from, after a scan of the vertices each occupied voxel stores.
+
+  The output buffers are sized from the scan results of each extraction and
+  only grow, so repeated extractions reuse them.
+
+  With -series=<list> the stages run over a sequence of volumes of the same
+  grid size. Reading and uploading the next volume and downloading the
+  triangles of the previous one overlap the kernels of the current one.
+
+  With -bench=<reps> the extraction runs -warmup=<n> (default 1) times and
+  then reps times on a profiling queue, each time after uploading the volume
+  and followed by downloading the triangles. The device time of every stage
+  and copy comes from its SYCL event; the minimum, median and mean over the
+  repetitions are printed, with voxels per second and the bandwidth of the
+  copies, and written with -json=<file>.
 */
 
 // includes
@@ -65,6 +89,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <string>
+#include <vector>
 //#include "helper_math.h"
 #include "helper_string.h"
 
@@ -72,55 +102,89 @@
 //#include <dpct/dpct.hpp>
 
 #include "defines.h"
-
-extern "C" void launch_classifyVoxel(sycl::queue &q, sycl::range<3> globalRange,
-                                     uint *voxelVerts, uint *voxelOccupied, uchar *volume,
-                                     sycl::uint3 gridSize, sycl::uint3 gridSizeShift,
-                                     sycl::uint3 gridSizeMask, uint numVoxels,
-                                     sycl::float3 voxelSize, float isoValue);
-
-extern "C" void launch_compactVoxels(sycl::queue &q, sycl::range<3> globalRange,
-                                     uint *compactedVoxelArray, uint *voxelOccupied,
-                                     uint *voxelOccupiedScan, uint numVoxels);
-
-extern "C" void launch_generateTriangles(sycl::queue &q, sycl::range<3> globalRange,
-                                         sycl::float4 *pos, sycl::float4 *norm,
-                                         uint *compactedVoxelArray,uint *numVertsScanned,
-                                         sycl::uint3 gridSize, sycl::uint3 gridSizeShift,
-                                         sycl::uint3 gridSizeMask, sycl::float3 voxelSize,
-                                         float isoValue, uint activeVoxels, uint maxVerts);
-
-extern "C" void allocateTextures(sycl::queue &q, uint **d_edgeTable, uint **d_triTable,
-                                 uint **d_numVertsTable);
-extern "C" void createVolumeTexture(uchar *d_volume, size_t buffSize);
-extern "C" void destroyAllTextureObjects();
-extern "C" void ThrustScanWrapper(unsigned int *output, unsigned int *input,
-                                  unsigned int numElements);
+#include "marchingCubes_kernel.h"
 
 const char *volumeFilename = "Bucky.raw";
 
+// -grid/-gridx/-gridy/-gridz give log2 sizes like the CUDA sample, -size
+// any size
 sycl::uint3 gridSizeLog2 = sycl::uint3(5, 5, 5);
-sycl::uint3 gridSizeShift;
 sycl::uint3 gridSize;
-sycl::uint3 gridSizeMask;
+
+// voxel type of the volume files, set by -type
+enum VolumeType { VOLUME_UINT8, VOLUME_UINT16, VOLUME_FLOAT };
+VolumeType volumeType = VOLUME_UINT8;
+size_t voxelBytes = sizeof(uchar);
 
 sycl::float3 voxelSize;
 uint numVoxels = 0;
-uint maxVerts = 0;
 uint activeVoxels = 0;
 uint totalVerts = 0;
+uint activeBricks = 0;
+// vertices stored by an indexed mesh; totalVerts is then its index count
+uint meshVerts = 0;
 
 float isoValue = 0.2f;
 float dIsoValue = 0.005f;
+// isovalues of the multi-level mode and the occupied voxels and vertices of
+// each level of the last extraction
+IsoLevels isoLevels;
+uint levelTotals[2 * MAX_ISO_LEVELS];
+
+// Triangle output, sized from the scan of every extraction. It only grows,
+// by at least half its size, so later volumes reuse the allocation; pinned
+// host arenas receive the downloads of the time-series mode.
+struct VertexArena {
+  sycl::usm::alloc kind;
+  sycl::float4 *pos = nullptr, *normal = nullptr;
+  uint *index = nullptr;
+  uint vertCapacity = 0, indexCapacity = 0;
+
+  explicit VertexArena(sycl::usm::alloc kind = sycl::usm::alloc::device) : kind(kind) {}
+
+  // q is the queue of the last users of the current buffers
+  void reserve(sycl::queue &q, uint verts, uint indices) {
+    if (verts > vertCapacity) {
+      q.wait();
+      sycl::free(pos, q);
+      sycl::free(normal, q);
+      vertCapacity = std::max(verts, vertCapacity + vertCapacity / 2);
+      pos = sycl::malloc<sycl::float4>(vertCapacity, q, kind);
+      normal = sycl::malloc<sycl::float4>(vertCapacity, q, kind);
+    }
+    if (indices > indexCapacity) {
+      q.wait();
+      sycl::free(index, q);
+      indexCapacity = std::max(indices, indexCapacity + indexCapacity / 2);
+      index = sycl::malloc<uint>(indexCapacity, q, kind);
+    }
+  }
 
-sycl::float4 *d_pos = nullptr, *d_normal = nullptr;
+  void release(sycl::queue &q) {
+    sycl::free(pos, q);
+    sycl::free(normal, q);
+    sycl::free(index, q);
+    pos = normal = nullptr;
+    index = nullptr;
+    vertCapacity = indexCapacity = 0;
+  }
+};
+
+VertexArena d_output;
 
-uchar *d_volume = nullptr;
-uint *d_voxelVerts = nullptr;
+void *d_volume = nullptr;
 uint *d_voxelVertsScan = nullptr;
-uint *d_voxelOccupied = nullptr;
-uint *d_voxelOccupiedScan = nullptr;
 uint *d_compVoxelArray = nullptr;
+uchar *d_compCubeIndex = nullptr;
+// indexed mesh: compacted position of the occupied voxels by candidate
+// index, and the first stored vertex of each occupied voxel
+uint *d_candidateSlot = nullptr;
+uint *d_vertexBase = nullptr;
+// multi-level mode: level of each compacted entry
+uchar *d_compLevel = nullptr;
+uint *d_totals = nullptr;
+// voxels the compacted arrays above can hold
+uint compactCapacity = 0;
 
 // tables
 uint *d_numVertsTable = nullptr;
@@ -128,14 +192,54 @@ uint *d_edgeTable = nullptr;
 uint *d_triTable = nullptr;
 
 bool g_bValidate = false;
+bool g_bSparse = false;
+bool g_bTiled = false;
+bool g_bIndexed = false;
+bool g_bLevels = false;
+bool g_bProfile = false;
+
+// Stages of the last extraction, recorded on a profiling queue only: the
+// event of each kernel launch and copy, with the bytes of the copies.
+struct StageEvent {
+  const char *name;
+  size_t bytes;
+  sycl::event event;
+};
+std::vector<StageEvent> g_stageEvents;
+
+sycl::event profile(const char *name, sycl::event e, size_t bytes = 0) {
+  if (g_bProfile) g_stageEvents.push_back({name, bytes, e});
+  return e;
+}
+
+// Every allocation, copy and kernel of the sample goes through this queue,
+// so they all share one device context. It is in-order, so launches only
+// wait where the host reads results back. g_bProfile must be set before the
+// first call.
+sycl::queue &getQueue() {
+  static sycl::queue q =
+      g_bProfile ? sycl::queue{sycl::property_list{sycl::property::queue::in_order(),
+                                                   sycl::property::queue::enable_profiling()}}
+                 : sycl::queue{sycl::property::queue::in_order()};
+  return q;
+}
 
 int *pArgc = nullptr;
 char **pArgv = nullptr;
 
 // forward declarations
 void runAutoTest(int argc, char **argv);
+void runSeries(int argc, char **argv);
+void runBenchmark(int argc, char **argv);
 void initMC(int argc, char **argv);
-void computeIsosurface();
+void reserveVoxelArrays(uint numCandidates, uint numEntries);
+sycl::event computeIsosurface(VertexArena &out, const std::vector<sycl::event> &deps = {});
+template <class T>
+sycl::event computeIsosurface(VertexArena &out, const std::vector<sycl::event> &deps,
+                              const T *volume);
+template <class T>
+sycl::event computeLevels(VertexArena &out, const std::vector<sycl::event> &deps,
+                          const T *volume, const uint *brickList, uint numCandidates);
 void dumpFile(void *dData, int data_bytes, const char *file_name);
 
 template <class T>
@@ -150,7 +254,7 @@ void cleanup();
 ////////////////////////////////////////////////////////////////////////////////
 // Load raw data from disk
 ////////////////////////////////////////////////////////////////////////////////
-uchar *loadRawFile(char *filename, int size) {
+uchar *loadRawFile(char *filename, size_t size) {
   FILE *fp = fopen(filename, "rb");
 
   if (!fp) {
@@ -162,14 +266,14 @@ uchar *loadRawFile(char *filename, int size) {
   size_t read = fread(data, 1, size, fp);
   fclose(fp);
 
-  printf("Read '%s', %d bytes\n", filename, (int)read);
+  printf("Read '%s', %zu bytes\n", filename, read);
 
   return data;
 }
 
 void dumpFile(void *dData, int data_bytes, const char *file_name) {
   void *hData = malloc(data_bytes);
-  sycl::queue q;
+  sycl::queue &q = getQueue();
   q.memcpy(hData, dData, data_bytes).wait();
   FILE *fp = fopen(file_name, "wb");
   fwrite(hData, 1, data_bytes, fp);
@@ -181,7 +285,7 @@ template <class T>
 void dumpBuffer(T *d_buffer, int nelements, int size_element) {
   uint bytes = nelements * size_element;
   T *h_buffer = (T *)malloc(bytes);
-  sycl::queue q;
+  sycl::queue &q = getQueue();
   q.memcpy(h_buffer, d_buffer, bytes).wait();
 
   for (int i = 0; i < nelements; i++) {
@@ -193,12 +297,13 @@ void dumpBuffer(T *d_buffer, int nelements, int size_element) {
 }
 
 void runAutoTest(int argc, char **argv) {
-  sycl::queue q;
+  sycl::queue &q = getQueue();
 
   // Initialize CUDA buffers for Marching Cubes
   initMC(argc, argv);
 
-  computeIsosurface();
+  computeIsosurface(d_output);
+  q.wait();
 
   /*
 
@@ -212,19 +317,19 @@ void runAutoTest(int argc, char **argv) {
 
   switch (dump_option) {
     case DUMP_POS:
-      dumpFile((void *)d_pos, sizeof(float4) * maxVerts,
+      dumpFile((void *)d_output.pos, sizeof(float4) * totalVerts,
                "marchCube_posArray.bin");
       bTestResult = sdkCompareBin2BinFloat(
           "marchCube_posArray.bin", "posArray.bin",
-          maxVerts * sizeof(float) * 4, EPSILON, THRESHOLD, argv[0]);
+          totalVerts * sizeof(float) * 4, EPSILON, THRESHOLD, argv[0]);
       break;
 
     case DUMP_NORMAL:
-      dumpFile((void *)d_normal, sizeof(float4) * maxVerts,
+      dumpFile((void *)d_output.normal, sizeof(float4) * totalVerts,
                "marchCube_normalArray.bin");
       bTestResult = sdkCompareBin2BinFloat(
           "marchCube_normalArray.bin", "normalArray.bin",
-          maxVerts * sizeof(float) * 4, EPSILON, THRESHOLD, argv[0]);
+          totalVerts * sizeof(float) * 4, EPSILON, THRESHOLD, argv[0]);
       break;
 
     case DUMP_VOXEL:
@@ -248,6 +353,299 @@ void runAutoTest(int argc, char **argv) {
   */
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Extract the isosurface of every volume named in the -series list file (one
+// raw file per line, all of the size given by -grid*) and write the
+// triangles of <name> to <name>.pos.bin and <name>.normal.bin, float4 each.
+// Indexed meshes also get <name>.index.bin, three vertex indices per
+// triangle.
+//
+// Volumes and triangle buffers are double-buffered. While the kernels of
+// frame n run on the compute queue, a host thread reads frame n + 1 into
+// pinned memory and a copy queue uploads it, while another copy queue
+// downloads the triangles of frame n - 1. Separate copy queues keep an
+// upload from waiting behind a download that waits for its kernel.
+////////////////////////////////////////////////////////////////////////////////
+void runSeries(int argc, char **argv) {
+  char *listFile;
+  getCmdLineArgumentString(argc, (const char **)argv, "series", &listFile);
+
+  std::vector<std::string> frames;
+  std::ifstream list(listFile);
+  if (!list.is_open()) {
+    fprintf(stderr, "Error opening file '%s'\n", listFile);
+    exit(EXIT_FAILURE);
+  }
+  std::string line;
+  while (std::getline(list, line)) {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty() && line[0] != '#') frames.push_back(line);
+  }
+  if (frames.empty()) {
+    fprintf(stderr, "No volumes listed in '%s'\n", listFile);
+    exit(EXIT_FAILURE);
+  }
+
+  initMC(argc, argv);
+  sycl::queue &q = getQueue();
+  sycl::queue uploadQueue(q.get_context(), q.get_device(), sycl::property::queue::in_order());
+  sycl::queue downloadQueue(q.get_context(), q.get_device(),
+                            sycl::property::queue::in_order());
+
+  // slot 0 uses the device output of single volumes
+  const size_t volumeBytes = numVoxels * voxelBytes;
+  uchar *h_volume[2], *d_volumes[2];
+  VertexArena d_outputs[2], h_outputs[2] = {VertexArena(sycl::usm::alloc::host),
+                                            VertexArena(sycl::usm::alloc::host)};
+  std::swap(d_outputs[0], d_output);
+  for (int b = 0; b < 2; b++) {
+    h_volume[b] = sycl::malloc_host<uchar>(volumeBytes, q);
+    d_volumes[b] = sycl::malloc_device<uchar>(volumeBytes, q);
+  }
+
+  auto readFrame = [&](size_t n) {
+    FILE *fp = fopen(frames[n].c_str(), "rb");
+    size_t read = fp ? fread(h_volume[n % 2], 1, volumeBytes, fp) : 0;
+    if (fp) fclose(fp);
+    return read == volumeBytes;
+  };
+
+  sycl::event uploaded[2], downloaded[2];
+  uint frameVerts[2] = {0, 0}, frameIndices[2] = {0, 0};
+
+  auto writeFrame = [&](size_t n) {
+    const int b = n % 2;
+    downloaded[b].wait();
+    const std::string name = frames[n].substr(frames[n].find_last_of('/') + 1);
+    FILE *fp = fopen((name + ".pos.bin").c_str(), "wb");
+    fwrite(h_outputs[b].pos, sizeof(sycl::float4), frameVerts[b], fp);
+    fclose(fp);
+    fp = fopen((name + ".normal.bin").c_str(), "wb");
+    fwrite(h_outputs[b].normal, sizeof(sycl::float4), frameVerts[b], fp);
+    fclose(fp);
+    if (g_bIndexed) {
+      fp = fopen((name + ".index.bin").c_str(), "wb");
+      fwrite(h_outputs[b].index, sizeof(uint), frameIndices[b], fp);
+      fclose(fp);
+    }
+  };
+
+  printf("Processing %zu volumes\n", frames.size());
+  const auto start = std::chrono::steady_clock::now();
+  std::future<bool> reading = std::async(std::launch::async, readFrame, 0);
+
+  for (size_t n = 0; n < frames.size(); n++) {
+    const int b = n % 2;
+
+    if (!reading.get()) {
+      fprintf(stderr, "Error reading file '%s'\n", frames[n].c_str());
+      exit(EXIT_FAILURE);
+    }
+    // the kernels of frame n - 2, the last reader of this slot's volume,
+    // finished before the totals of frame n - 1 were read back
+    uploaded[b] = uploadQueue.memcpy(d_volumes[b], h_volume[b], volumeBytes);
+
+    if (n + 1 < frames.size()) {
+      // the other staging buffer is free once frame n - 1 is uploaded
+      uploaded[1 - b].wait();
+      reading = std::async(std::launch::async, readFrame, n + 1);
+    }
+
+    // this slot's triangle buffers still hold frame n - 2
+    if (n >= 2) writeFrame(n - 2);
+
+    d_volume = d_volumes[b];
+    sycl::event triangles = computeIsosurface(d_outputs[b], {uploaded[b]});
+
+    frameVerts[b] = g_bIndexed ? meshVerts : totalVerts;
+    frameIndices[b] = g_bIndexed ? totalVerts : 0;
+    h_outputs[b].reserve(downloadQueue, frameVerts[b], frameIndices[b]);
+    const size_t vertexBytes = frameVerts[b] * sizeof(sycl::float4);
+    downloadQueue.memcpy(h_outputs[b].pos, d_outputs[b].pos, vertexBytes, triangles);
+    downloadQueue.memcpy(h_outputs[b].index, d_outputs[b].index, frameIndices[b] * sizeof(uint),
+                         triangles);
+    downloaded[b] = downloadQueue.memcpy(h_outputs[b].normal, d_outputs[b].normal, vertexBytes,
+                                         triangles);
+
+    printf("%s: %u active voxels, %u vertices\n", frames[n].c_str(), activeVoxels,
+           totalVerts);
+  }
+
+  for (size_t n = frames.size() > 2 ? frames.size() - 2 : 0; n < frames.size(); n++)
+    writeFrame(n);
+
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Processed %zu volumes in %.3f s (%.2f volumes/s)\n", frames.size(), seconds,
+         frames.size() / seconds);
+
+  // hand slot 0 back to cleanup()
+  d_volume = nullptr;
+  std::swap(d_outputs[0], d_output);
+  d_outputs[1].release(q);
+  for (int b = 0; b < 2; b++) {
+    sycl::free(h_volume[b], q);
+    sycl::free(d_volumes[b], q);
+    h_outputs[b].release(q);
+  }
+  cleanup();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark of the extraction (-bench=<reps>). Every repetition uploads the
+// volume from pinned memory, extracts the isosurface and downloads the
+// triangles; the time of each stage is the sum of its events in that
+// repetition, transfers are the events that moved bytes.
+////////////////////////////////////////////////////////////////////////////////
+struct BenchStats {
+  double min, median, mean;
+};
+
+BenchStats benchStats(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  double sum = 0.0;
+  for (double x : v) sum += x;
+  const size_t n = v.size();
+  return {v.front(), n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]), sum / n};
+}
+
+double eventMicroseconds(const sycl::event &e) {
+  return 1.e-3 * (e.get_profiling_info<sycl::info::event_profiling::command_end>() -
+                  e.get_profiling_info<sycl::info::event_profiling::command_start>());
+}
+
+void printStats(FILE *fp, const char *key, const BenchStats &t) {
+  fprintf(fp, "\"%s\": {\"min\": %g, \"median\": %g, \"mean\": %g}", key, t.min, t.median,
+          t.mean);
+}
+
+void runBenchmark(int argc, char **argv) {
+  const int reps = getCmdLineArgumentInt(argc, (const char **)argv, "bench");
+  const int warmup = checkCmdLineFlag(argc, (const char **)argv, "warmup")
+                         ? getCmdLineArgumentInt(argc, (const char **)argv, "warmup")
+                         : 1;
+  if (reps < 1 || warmup < 0) {
+    fprintf(stderr, "Invalid -bench=%d -warmup=%d\n", reps, warmup);
+    exit(EXIT_FAILURE);
+  }
+
+  initMC(argc, argv);
+  sycl::queue &q = getQueue();
+  if (!d_volume) {
+    fprintf(stderr, "-bench needs a volume file\n");
+    exit(EXIT_FAILURE);
+  }
+  const size_t volumeBytes = size_t(numVoxels) * voxelBytes;
+  uchar *h_volume = sycl::malloc_host<uchar>(volumeBytes, q);
+  q.memcpy(h_volume, d_volume, volumeBytes).wait();
+  VertexArena h_output(sycl::usm::alloc::host);
+
+  // per stage, in order of first launch, its time in every repetition
+  std::vector<std::pair<std::string, std::vector<double>>> stages;
+  std::vector<size_t> stageBytes;
+  std::vector<double> wall, kernel, transfer;
+  size_t bytes = 0;
+
+  for (int r = 0; r < warmup + reps; r++) {
+    g_stageEvents.clear();
+    const auto start = std::chrono::steady_clock::now();
+    sycl::event uploaded = profile("upload", q.memcpy(d_volume, h_volume, volumeBytes),
+                                   volumeBytes);
+    computeIsosurface(d_output, {uploaded});
+
+    const uint verts = g_bIndexed ? meshVerts : totalVerts;
+    const uint indices = g_bIndexed ? totalVerts : 0;
+    h_output.reserve(q, verts, indices);
+    const size_t vertexBytes = verts * sizeof(sycl::float4);
+    profile("download", q.memcpy(h_output.pos, d_output.pos, vertexBytes), vertexBytes);
+    profile("download", q.memcpy(h_output.normal, d_output.normal, vertexBytes), vertexBytes);
+    if (indices)
+      profile("download", q.memcpy(h_output.index, d_output.index, indices * sizeof(uint)),
+              indices * sizeof(uint));
+    q.wait();
+    const double elapsed =
+        std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+            .count();
+    if (r < warmup) continue;
+
+    for (auto &stage : stages) stage.second.push_back(0.0);
+    double kernelTime = 0.0, transferTime = 0.0;
+    bytes = 0;
+    for (const StageEvent &s : g_stageEvents) {
+      auto it = std::find_if(stages.begin(), stages.end(),
+                             [&](const auto &stage) { return stage.first == s.name; });
+      if (it == stages.end()) {
+        stages.emplace_back(s.name, std::vector<double>(r - warmup + 1, 0.0));
+        stageBytes.push_back(0);
+        it = stages.end() - 1;
+      }
+      const double t = eventMicroseconds(s.event);
+      it->second.back() += t;
+      if (r == warmup) stageBytes[it - stages.begin()] += s.bytes;
+      (s.bytes ? transferTime : kernelTime) += t;
+      bytes += s.bytes;
+    }
+    wall.push_back(elapsed);
+    kernel.push_back(kernelTime);
+    transfer.push_back(transferTime);
+  }
+
+  const BenchStats wallStats = benchStats(wall), kernelStats = benchStats(kernel),
+                   transferStats = benchStats(transfer);
+  const double voxelsPerSecond = numVoxels / (kernelStats.median * 1.e-6);
+  const double gbPerSecond = bytes / (transferStats.median * 1.e3);
+  const std::string device = q.get_device().get_info<sycl::info::device::name>();
+  const uint vertices = g_bIndexed ? meshVerts : totalVerts;
+
+  printf("Device: %s\n", device.c_str());
+  printf("%u voxels, %u active, %u vertices; warmup %d, reps %d (median times in us)\n",
+         numVoxels, activeVoxels, vertices, warmup, reps);
+  for (size_t i = 0; i < stages.size(); i++) {
+    const BenchStats t = benchStats(stages[i].second);
+    if (stageBytes[i])
+      printf("  %-26s %12.3f  %zu bytes, %.3f GB/s\n", stages[i].first.c_str(), t.median,
+             stageBytes[i], stageBytes[i] / (t.median * 1.e3));
+    else
+      printf("  %-26s %12.3f\n", stages[i].first.c_str(), t.median);
+  }
+  printf("kernels %.3f us (%.4g voxels/s), transfers %.3f us (%.3f GB/s), wall %.3f us\n",
+         kernelStats.median, voxelsPerSecond, transferStats.median, gbPerSecond,
+         wallStats.median);
+
+  char *jsonFile;
+  if (getCmdLineArgumentString(argc, (const char **)argv, "json", &jsonFile)) {
+    FILE *fp = fopen(jsonFile, "w");
+    if (!fp) {
+      fprintf(stderr, "Error opening file '%s'\n", jsonFile);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "{\n  \"module\": \"03-marchingCubes\",\n  \"device\": \"%s\",\n",
+            device.c_str());
+    fprintf(fp, "  \"input\": \"%s\",\n  \"voxels\": %u,\n", volumeFilename, numVoxels);
+    fprintf(fp, "  \"active_voxels\": %u,\n  \"vertices\": %u,\n", activeVoxels, vertices);
+    fprintf(fp, "  \"warmup\": %d,\n  \"reps\": %d,\n  \"stages\": [\n", warmup, reps);
+    for (size_t i = 0; i < stages.size(); i++) {
+      fprintf(fp, "    {\"stage\": \"%s\", ", stages[i].first.c_str());
+      printStats(fp, "us", benchStats(stages[i].second));
+      fprintf(fp, ", \"bytes\": %zu}%s\n", stageBytes[i], i + 1 < stages.size() ? "," : "");
+    }
+    fprintf(fp, "  ],\n  ");
+    printStats(fp, "wall_us", wallStats);
+    fprintf(fp, ",\n  ");
+    printStats(fp, "kernel_us", kernelStats);
+    fprintf(fp, ",\n  ");
+    printStats(fp, "transfer_us", transferStats);
+    fprintf(fp, ",\n  \"transfer_bytes\": %zu,\n  \"voxels_per_s\": %g,\n", bytes,
+            voxelsPerSecond);
+    fprintf(fp, "  \"transfer_gb_per_s\": %g\n}\n", gbPerSecond);
+    fclose(fp);
+  }
+
+  sycl::free(h_volume, q);
+  h_output.release(q);
+  cleanup();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Program main
 ////////////////////////////////////////////////////////////////////////////////
@@ -261,6 +659,11 @@ int main(int argc, char **argv) {
       checkCmdLineFlag(argc, (const char **)argv, "dump")) {
     g_bValidate = true;
     runAutoTest(argc, argv);
+  } else if (checkCmdLineFlag(argc, (const char **)argv, "series")) {
+    runSeries(argc, argv);
+  } else if (checkCmdLineFlag(argc, (const char **)argv, "bench")) {
+    g_bProfile = true;
+    runBenchmark(argc, argv);
   } else {
     runAutoTest(argc, argv);
   }
@@ -273,7 +676,7 @@ int main(int argc, char **argv) {
 ////////////////////////////////////////////////////////////////////////////////
 void initMC(int argc, char **argv) {
   printf("Starting `initMC`\n");
-  sycl::queue q;
+  sycl::queue &q = getQueue();
   // parse command line arguments
   int n;
 
@@ -287,8 +690,8 @@ void initMC(int argc, char **argv) {
     gridSizeLog2.x() = n;
   }
 
-  if (checkCmdLineFlag(argc, (const char **)argv, "gridx")) {
-    n = getCmdLineArgumentInt(argc, (const char **)argv, "gridx");
+  if (checkCmdLineFlag(argc, (const char **)argv, "gridy")) {
+    n = getCmdLineArgumentInt(argc, (const char **)argv, "gridy");
     gridSizeLog2.y() = n;
   }
 
@@ -297,88 +700,180 @@ void initMC(int argc, char **argv) {
     gridSizeLog2.z() = n;
   }
 
+  gridSize =
+      sycl::uint3(1 << gridSizeLog2.x(), 1 << gridSizeLog2.y(), 1 << gridSizeLog2.z());
+
+  char *arg;
+
+  if (getCmdLineArgumentString(argc, (const char **)argv, "size", &arg)) {
+    uint x, y, z;
+    if (sscanf(arg, "%ux%ux%u", &x, &y, &z) != 3 || !x || !y || !z) {
+      fprintf(stderr, "Invalid -size=%s, expected <x>x<y>x<z>\n", arg);
+      exit(EXIT_FAILURE);
+    }
+    gridSize = sycl::uint3(x, y, z);
+  }
+
+  if (getCmdLineArgumentString(argc, (const char **)argv, "type", &arg)) {
+    if (!strcmp(arg, "uint8")) {
+      volumeType = VOLUME_UINT8;
+      voxelBytes = sizeof(uchar);
+    } else if (!strcmp(arg, "uint16")) {
+      volumeType = VOLUME_UINT16;
+      voxelBytes = sizeof(ushort);
+    } else if (!strcmp(arg, "float")) {
+      volumeType = VOLUME_FLOAT;
+      voxelBytes = sizeof(float);
+    } else {
+      fprintf(stderr, "Invalid -type=%s, expected uint8, uint16 or float\n", arg);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // integer volumes are normalized to [0, 1], float ones are compared as
+  // they are
+  if (checkCmdLineFlag(argc, (const char **)argv, "iso")) {
+    isoValue = getCmdLineArgumentFloat(argc, (const char **)argv, "iso");
+  }
+
+  g_bSparse = checkCmdLineFlag(argc, (const char **)argv, "sparse");
+  g_bTiled = checkCmdLineFlag(argc, (const char **)argv, "tiled");
+  g_bIndexed = checkCmdLineFlag(argc, (const char **)argv, "indexed");
+
+  if (checkCmdLineFlag(argc, (const char **)argv, "diso")) {
+    dIsoValue = getCmdLineArgumentFloat(argc, (const char **)argv, "diso");
+  }
+
+  isoLevels.count = 0;
+  if (getCmdLineArgumentString(argc, (const char **)argv, "levels", &arg)) {
+    for (char *v = strtok(arg, ","); v; v = strtok(nullptr, ",")) {
+      if (isoLevels.count == MAX_ISO_LEVELS) {
+        fprintf(stderr, "At most %d isovalues in -levels\n", MAX_ISO_LEVELS);
+        exit(EXIT_FAILURE);
+      }
+      isoLevels.value[isoLevels.count++] = atof(v);
+    }
+  } else if (checkCmdLineFlag(argc, (const char **)argv, "nlevels")) {
+    n = getCmdLineArgumentInt(argc, (const char **)argv, "nlevels");
+    if (n < 1 || n > MAX_ISO_LEVELS) {
+      fprintf(stderr, "Invalid -nlevels=%d, expected 1 to %d\n", n, MAX_ISO_LEVELS);
+      exit(EXIT_FAILURE);
+    }
+    for (int l = 0; l < n; l++) isoLevels.value[isoLevels.count++] = isoValue + l * dIsoValue;
+  }
+  g_bLevels = isoLevels.count > 0;
+  if (g_bLevels && g_bIndexed) {
+    fprintf(stderr, "-levels does not support -indexed\n");
+    exit(EXIT_FAILURE);
+  }
+
   char *filename;
 
   if (getCmdLineArgumentString(argc, (const char **)argv, "file", &filename)) {
     volumeFilename = filename;
   }
 
-  gridSize =
-      sycl::uint3(1 << gridSizeLog2.x(), 1 << gridSizeLog2.y(), 1 << gridSizeLog2.z());
-  gridSizeMask = sycl::uint3(gridSize.x() - 1, gridSize.y() - 1, gridSize.z() - 1);
-  gridSizeShift =
-      sycl::uint3(0, gridSizeLog2.x(), gridSizeLog2.x() + gridSizeLog2.y());
-
   numVoxels = gridSize.x() * gridSize.y() * gridSize.z();
   voxelSize =
       sycl::float3(2.0f / gridSize.x(), 2.0f / gridSize.y(), 2.0f / gridSize.z());
-  maxVerts = gridSize.x() * gridSize.y() * 100;
 
   printf("grid: %d x %d x %d = %d voxels\n", gridSize.x(), gridSize.y(), gridSize.z(),
          numVoxels);
-  printf("max verts = %d\n", maxVerts);
 
 #if SAMPLE_VOLUME
-  // load volume data
-  printf("Loading volume data\n");
-  char *path = sdkFindFilePath(volumeFilename, argv[0]);
+  // in series mode the volumes are streamed in by runSeries
+  if (!checkCmdLineFlag(argc, (const char **)argv, "series")) {
+    // load volume data
+    printf("Loading volume data\n");
+    char *path = sdkFindFilePath(volumeFilename, argv[0]);
 
-  if (path == nullptr) {
-    fprintf(stderr, "Error finding file '%s'\n", volumeFilename);
+    if (path == nullptr) {
+      fprintf(stderr, "Error finding file '%s'\n", volumeFilename);
 
-    exit(EXIT_FAILURE);
-  }
-  printf("Setting grid size\n");
+      exit(EXIT_FAILURE);
+    }
+    printf("Setting grid size\n");
 
-  int size = gridSize.x() * gridSize.y() * gridSize.z() * sizeof(uchar);
-  uchar *volume = loadRawFile(path, size);
+    size_t size = size_t(numVoxels) * voxelBytes;
+    uchar *volume = loadRawFile(path, size);
 
-  printf("Setting device memory\n");
-  d_volume = static_cast<uchar *>(sycl::malloc_device(size, q));
-  q.memcpy(d_volume, volume, size).wait();
-  free(volume);
+    printf("Setting device memory\n");
+    d_volume = sycl::malloc_device(size, q);
+    q.memcpy(d_volume, volume, size).wait();
+    free(volume);
 
-  printf("Starting `createVolumeTexture`\n");
-  createVolumeTexture(d_volume, size);
-  
-  printf("Finished loading volume data\n");
+    printf("Finished loading volume data\n");
+  }
 #endif
 
-  if (g_bValidate) {
-    d_pos = static_cast<sycl::float4 *>(sycl::malloc_device(maxVerts * sizeof(float) * 4, q));
-    d_normal = static_cast<sycl::float4 *>(sycl::malloc_device(maxVerts * sizeof(float) * 4, q));
-  }
+  // there is no vertex buffer object to render into, so the triangles go
+  // to d_output, which computeIsosurface sizes from the scan
 
   // allocate textures
   allocateTextures(q, &d_edgeTable, &d_triTable, &d_numVertsTable);
 
-  // allocate device memory
-  unsigned int memSize = sizeof(uint) * numVoxels;
-  d_voxelVerts = static_cast<uint *>(sycl::malloc_device(memSize, q));
-  d_voxelVertsScan = static_cast<uint *>(sycl::malloc_device(memSize, q));
-  d_voxelOccupied = static_cast<uint *>(sycl::malloc_device(memSize, q));
-  d_voxelOccupiedScan = static_cast<uint *>(sycl::malloc_device(memSize, q));
-  d_compVoxelArray = static_cast<uint *>(sycl::malloc_device(memSize, q));
+  // allocate device memory; in sparse mode the compacted arrays and the
+  // scan state follow the active bricks of each volume
+  d_totals = static_cast<uint *>(sycl::malloc_device(2 * MAX_ISO_LEVELS * sizeof(uint), q));
+  if (g_bSparse) {
+    allocateBrickState(q, gridSize);
+    printf("sparse mode: %d bricks of %d^3 voxels\n", numBricks, BRICK_SIZE);
+  } else if (g_bTiled) {
+    allocateBrickState(q, gridSize);
+    listAllBricks(q);
+    reserveVoxelArrays(numBricks * BRICK_VOXELS, numBricks * BRICK_VOXELS);
+    printf("tiled mode: %d bricks of %d^3 voxels\n", numBricks, BRICK_SIZE);
+  } else {
+    reserveVoxelArrays(numVoxels, numVoxels);
+  }
 
   printf("Finished `initMC`\n");
 }
 
-void cleanup() {
-  sycl::queue q;
-  if (g_bValidate) {
-          sycl::free(d_pos, q);
-          sycl::free(d_normal, q);
+////////////////////////////////////////////////////////////////////////////////
+// Grow the scan state to classify numCandidates voxels and the compacted
+// arrays to hold numEntries of them; more entries than candidates only occur
+// with several levels
+////////////////////////////////////////////////////////////////////////////////
+void reserveVoxelArrays(uint numCandidates, uint numEntries) {
+  sycl::queue &q = getQueue();
+  allocateScanState(q, numCandidates, g_bLevels ? isoLevels.count : 1);
+  if (numEntries <= compactCapacity) return;
+
+  q.wait();
+  sycl::free(d_voxelVertsScan, q);
+  sycl::free(d_compVoxelArray, q);
+  sycl::free(d_compCubeIndex, q);
+  sycl::free(d_candidateSlot, q);
+  sycl::free(d_vertexBase, q);
+  sycl::free(d_compLevel, q);
+  compactCapacity = numEntries;
+  d_voxelVertsScan = sycl::malloc_device<uint>(compactCapacity, q);
+  d_compVoxelArray = sycl::malloc_device<uint>(compactCapacity, q);
+  d_compCubeIndex = sycl::malloc_device<uchar>(compactCapacity, q);
+  if (g_bIndexed) {
+    d_candidateSlot = sycl::malloc_device<uint>(compactCapacity, q);
+    d_vertexBase = sycl::malloc_device<uint>(compactCapacity, q);
   }
+  if (g_bLevels) d_compLevel = sycl::malloc_device<uchar>(compactCapacity, q);
+}
+
+void cleanup() {
+  sycl::queue &q = getQueue();
+  d_output.release(q);
 
-  destroyAllTextureObjects();
+  destroyScanState(q);
+  destroyBrickState(q);
   sycl::free(d_edgeTable, q);
   sycl::free(d_triTable, q);
   sycl::free(d_numVertsTable, q);
-  sycl::free(d_voxelVerts, q);
   sycl::free(d_voxelVertsScan, q);
-  sycl::free(d_voxelOccupied, q);
-  sycl::free(d_voxelOccupiedScan, q);
   sycl::free(d_compVoxelArray, q);
+  sycl::free(d_compCubeIndex, q);
+  sycl::free(d_candidateSlot, q);
+  sycl::free(d_vertexBase, q);
+  sycl::free(d_compLevel, q);
+  sycl::free(d_totals, q);
 
   if (d_volume) {
           sycl::free(d_volume, q);
@@ -389,101 +884,150 @@ void cleanup() {
 
 ////////////////////////////////////////////////////////////////////////////////
 //! Run the **SYCL** part of the computation
+//! The classification waits for deps; the returned event completes when the
+//! triangles have been written to out (the host only waits for the totals).
 ////////////////////////////////////////////////////////////////////////////////
-void computeIsosurface() {
-  sycl::queue q;
-  int maxThreadsPerBlock = 1024;
-  int threads = std::min(128, maxThreadsPerBlock);
-  int numBlocks = (numVoxels + threads - 1) / threads;
-
-  numBlocks = std::min(numBlocks, 65535);
-  
-  // used w/ nd range
-  //sycl::range<3> grid(numBlocks, 1, 1);
-  //sycl::range<3> threads_range(threads, 1, 1);
-
-  sycl::range<3> globalRange(numBlocks, 1, threads);
-
-  // get around maximum grid size of 65535 in each dimension
-  //if (grid[0] > 65535) {
-    //grid[1] = grid[0] / 32768;
-    //grid[0] = 32768;
-  //}
-  printf("Starting `launch_classifyVoxel`\n");
-  // calculate number of vertices need per voxel
-  launch_classifyVoxel(q, globalRange, d_voxelVerts, d_voxelOccupied, d_volume,
-                       gridSize, gridSizeShift, gridSizeMask, numVoxels,
-                       voxelSize, isoValue);
-  printf("Finished `launch_classifyVoxel`\n");
-#if DEBUG_BUFFERS
-  printf("voxelVerts:\n");
-  dumpBuffer(d_voxelVerts, numVoxels, sizeof(uint));
-#endif
+sycl::event computeIsosurface(VertexArena &out, const std::vector<sycl::event> &deps) {
+  switch (volumeType) {
+    case VOLUME_UINT16:
+      return computeIsosurface(out, deps, static_cast<const ushort *>(d_volume));
+    case VOLUME_FLOAT:
+      return computeIsosurface(out, deps, static_cast<const float *>(d_volume));
+    default:
+      return computeIsosurface(out, deps, static_cast<const uchar *>(d_volume));
+  }
+}
 
-#if SKIP_EMPTY_VOXELS
-  // scan voxel occupied array
-  ThrustScanWrapper(d_voxelOccupiedScan, d_voxelOccupied, numVoxels);
+template <class T>
+sycl::event computeIsosurface(VertexArena &out, const std::vector<sycl::event> &deps,
+                              const T *volume) {
+  sycl::queue &q = getQueue();
+
+  // in sparse mode only the voxels of the bricks around the surface are
+  // classified
+  uint numCandidates = numVoxels;
+  const uint *brickList = nullptr;
+  std::vector<sycl::event> classifyDeps = deps;
+  if (g_bSparse) {
+    sycl::event bricks;
+    activeBricks = g_bLevels
+                       ? launch_findActiveBricks(q, deps, volume, gridSize, isoLevels, &bricks)
+                       : launch_findActiveBricks(q, deps, volume, gridSize, isoValue, &bricks);
+    profile("findActiveBricks", bricks);
+    printf("active bricks: %d of %d\n", activeBricks, numBricks);
+    numCandidates = activeBricks * BRICK_VOXELS;
+    brickList = d_brickList;
+    classifyDeps.clear();
+    if (numCandidates == 0) {
+      activeVoxels = totalVerts = meshVerts = 0;
+      return sycl::event();
+    }
+    reserveVoxelArrays(numCandidates, numCandidates);
+  } else if (g_bTiled) {
+    activeBricks = numBricks;
+    numCandidates = numBricks * BRICK_VOXELS;
+    brickList = d_brickList;
+  }
 
-#if DEBUG_BUFFERS
-  printf("voxelOccupiedScan:\n");
-  dumpBuffer(d_voxelOccupiedScan, numVoxels, sizeof(uint));
-#endif
+  if (g_bLevels) return computeLevels(out, classifyDeps, volume, brickList, numCandidates);
 
-  // read back values to calculate total number of non-empty voxels
-  // since we are using an exclusive scan, the total is the last value of
-  // the scan result plus the last value in the input array
+  printf("Starting `launch_classifyCompactVoxels`\n");
+  // classify voxels, scan their occupancy and vertex counts and compact the
+  // occupied ones, then read back both totals at once
+  profile("classifyCompactVoxels",
+          launch_classifyCompactVoxels(q, classifyDeps, d_compVoxelArray, d_compCubeIndex,
+                                       d_voxelVertsScan, d_candidateSlot, d_totals, volume,
+                                       d_numVertsTable, brickList, gridSize, numCandidates,
+                                       isoValue));
   {
-    uint lastElement, lastScanElement;
-    q.memcpy(&lastElement, d_voxelOccupied + numVoxels - 1, sizeof(uint)).wait();
-    q.memcpy(&lastScanElement, d_voxelOccupiedScan + numVoxels - 1, sizeof(uint)).wait();
-    activeVoxels = lastElement + lastScanElement;
+    uint totals[2];
+    profile("readTotals", q.memcpy(totals, d_totals, sizeof(totals)), sizeof(totals)).wait();
+    activeVoxels = totals[0];
+    totalVerts = totals[1];
   }
+  printf("Finished `launch_classifyCompactVoxels`\n");
+#if DEBUG_BUFFERS
+  printf("compVoxelArray:\n");
+  dumpBuffer(d_compVoxelArray, activeVoxels, sizeof(uint));
+  printf("voxelVertsScan:\n");
+  dumpBuffer(d_voxelVertsScan, activeVoxels, sizeof(uint));
+#endif
 
   if (activeVoxels == 0) {
     // return if there are no full voxels
-    totalVerts = 0;
-    return;
+    meshVerts = 0;
+    return sycl::event();
   }
 
-  // compact voxel index array
-  launch_compactVoxels(q, globalRange, d_compVoxelArray, d_voxelOccupied,
-                       d_voxelOccupiedScan, numVoxels);
-  q.wait();
-
-#endif  // SKIP_EMPTY_VOXELS
-
-  // scan voxel vertex count array
-  ThrustScanWrapper(d_voxelVertsScan, d_voxelVerts, numVoxels);
-
-#if DEBUG_BUFFERS
-  printf("voxelVertsScan:\n");
-  dumpBuffer(d_voxelVertsScan, numVoxels, sizeof(uint));
-#endif
-
-  // readback total number of vertices
-  {
-    uint lastElement, lastScanElement;
-    q.memcpy(&lastElement, d_voxelVerts + numVoxels - 1, sizeof(uint)).wait();
-    q.memcpy(&lastScanElement, d_voxelVertsScan + numVoxels - 1, sizeof(uint)).wait();
-    totalVerts = lastElement + lastScanElement;
+  if (g_bIndexed) {
+    // count the vertices each voxel stores, then emit them and the indices
+    // of all triangle corners
+    profile("scanMeshVertices",
+            launch_scanMeshVertices(q, d_vertexBase, d_totals, d_compVoxelArray,
+                                    d_compCubeIndex, d_edgeTable, gridSize, activeVoxels));
+    profile("readTotals", q.memcpy(&meshVerts, d_totals + 2, sizeof(uint)), sizeof(uint)).wait();
+    printf("indexed mesh: %u vertices, %u indices\n", meshVerts, totalVerts);
+
+    out.reserve(q, meshVerts, totalVerts);
+    return profile("generateIndexedTriangles",
+                   launch_generateIndexedTriangles(
+                       q, out.pos, out.normal, out.index, d_compVoxelArray, d_compCubeIndex,
+                       d_voxelVertsScan, d_vertexBase, d_candidateSlot, brickList != nullptr,
+                       volume, d_triTable, d_numVertsTable, d_edgeTable, gridSize, voxelSize,
+                       isoValue, activeVoxels));
   }
 
   // generate triangles, writing to vertex buffers
-#if SKIP_EMPTY_VOXELS
-  sycl::range<3> globalRange2((int)ceil(activeVoxels / (float)NTHREADS), 1, NTHREADS);
-#else
-  sycl::range<3> globalRange2((int)ceil(numVoxels / (float)NTHREADS), 1, NTHREADS);
-#endif
+  out.reserve(q, totalVerts, 0);
+  return profile("generateTriangles",
+                 launch_generateTriangles(q, out.pos, out.normal, d_compVoxelArray,
+                                          d_compCubeIndex, d_voxelVertsScan, volume, d_triTable,
+                                          d_numVertsTable, gridSize, voxelSize, isoValue,
+                                          activeVoxels));
+}
 
-  while (globalRange2[0] > 65535) {
-    globalRange2[0] /= 2;
-    globalRange2[1] *= 2;
+////////////////////////////////////////////////////////////////////////////////
+//! Multi-level extraction: classify the candidates against all isoLevels in
+//! one pass and write the meshes of every level in one launch. The compacted
+//! arrays are sized like a single level's; when all levels together have
+//! more occupied voxels, they grow and the classification runs again.
+////////////////////////////////////////////////////////////////////////////////
+template <class T>
+sycl::event computeLevels(VertexArena &out, const std::vector<sycl::event> &deps,
+                          const T *volume, const uint *brickList, uint numCandidates) {
+  sycl::queue &q = getQueue();
+
+  uint entries = 0;
+  for (std::vector<sycl::event> classifyDeps = deps;; classifyDeps.clear()) {
+    profile("classifyCompactLevels",
+            launch_classifyCompactLevels(q, classifyDeps, d_compVoxelArray, d_compCubeIndex,
+                                         d_compLevel, d_voxelVertsScan, d_totals, volume,
+                                         d_numVertsTable, brickList, gridSize, numCandidates,
+                                         compactCapacity, isoLevels));
+    const size_t bytes = 2 * isoLevels.count * sizeof(uint);
+    profile("readTotals", q.memcpy(levelTotals, d_totals, bytes), bytes).wait();
+
+    entries = totalVerts = 0;
+    for (uint l = 0; l < isoLevels.count; l++) {
+      entries += levelTotals[2 * l];
+      totalVerts += levelTotals[2 * l + 1];
+    }
+    if (entries <= compactCapacity) break;
+    reserveVoxelArrays(numCandidates, entries);
   }
+  activeVoxels = entries;
+  meshVerts = 0;
 
-  launch_generateTriangles(q, globalRange2, d_pos, d_normal, d_compVoxelArray,
-                           d_voxelVertsScan, gridSize, gridSizeShift,
-                           gridSizeMask, voxelSize, isoValue, activeVoxels,
-                           maxVerts);
-  q.wait();
-}
+  for (uint l = 0, first = 0; l < isoLevels.count; first += levelTotals[2 * l + 1], l++)
+    printf("level %u (iso %g): %u voxels, vertices %u to %u\n", l, isoLevels.value[l],
+           levelTotals[2 * l], first, first + levelTotals[2 * l + 1]);
+
+  if (entries == 0) return sycl::event();
 
+  out.reserve(q, totalVerts, 0);
+  return profile("generateLevelTriangles",
+                 launch_generateLevelTriangles(q, out.pos, out.normal, d_compVoxelArray,
+                                               d_compCubeIndex, d_compLevel, d_voxelVertsScan,
+                                               d_totals, volume, d_triTable, d_numVertsTable,
+                                               gridSize, voxelSize, isoLevels, entries));
+}
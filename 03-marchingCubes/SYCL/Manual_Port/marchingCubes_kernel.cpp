@@ -3,19 +3,15 @@
 
 #include <sycl/sycl.hpp>
 //#include <dpct/dpct.hpp>
-#include <oneapi/dpl/execution>
-#include <oneapi/dpl/algorithm>
+#include <cfloat>
 #include <cstring>
+#include <vector>
 #include "defines.h"
+#include "marchingCubes_kernel.h"
 #include "tables.h"
 
-// textures containing look-up tables
-sycl::buffer<uint, 1> *triTableBuf;
-sycl::buffer<uint, 1> *numVertsTableBuf;
-
-// volume data
-sycl::buffer<uchar, 1> *volumeBuf;
-
+// The look-up tables live in device memory; the kernels read them through
+// the USM pointers like the volume.
 extern "C" void allocateTextures(sycl::queue &q, uint **d_edgeTable, uint **d_triTable,
                                  uint **d_numVertsTable) {
   *d_edgeTable = static_cast<uint *>(sycl::malloc_device(256 * sizeof(uint), q));
@@ -24,85 +20,79 @@ extern "C" void allocateTextures(sycl::queue &q, uint **d_edgeTable, uint **d_tr
   *d_triTable = static_cast<uint *>(sycl::malloc_device(256 * 16 * sizeof(uint), q));
   q.memcpy(*d_triTable, triTable, 256 * 16 * sizeof(uint)).wait();
 
-  triTableBuf = new sycl::buffer<uint, 1>(*d_triTable, sycl::range<1>(256 * 16));
-
   *d_numVertsTable = static_cast<uint *>(sycl::malloc_device(256 * sizeof(uint), q));
   q.memcpy(*d_numVertsTable, numVertsTable, 256 * sizeof(uint)).wait();
-
-  numVertsTableBuf = new sycl::buffer<uint, 1>(*d_numVertsTable, sycl::range<1>(256));
-}
-
-extern "C" void createVolumeTexture(uchar *d_volume, size_t buffSize) {
-  volumeBuf = new sycl::buffer<uchar, 1>(d_volume, sycl::range<1>(buffSize));
-}
-
-extern "C" void destroyAllTextureObjects() {
-  delete triTableBuf;
-  delete numVertsTableBuf;
-  delete volumeBuf;
-}
-
-float tangle(float x, float y, float z) {
-  x *= 3.0f;
-  y *= 3.0f;
-  z *= 3.0f;
-  return (x * x * x * x - 5.0f * x * x + y * y * y * y - 5.0f * y * y +
-          z * z * z * z - 5.0f * z * z + 11.8f) * 0.2f + 0.5f;
-}
-
-float fieldFunc(sycl::float3 p) {
-  return tangle(p.x(), p.y(), p.z());
 }
 
-sycl::float4 fieldFunc4(sycl::float3 p) {
-  float v = tangle(p.x(), p.y(), p.z());
-  const float d = 0.001f;
-  float dx = tangle(p.x() + d, p.y(), p.z()) - v;
-  float dy = tangle(p.x(), p.y() + d, p.z()) - v;
-  float dz = tangle(p.x(), p.y(), p.z() + d) - v;
-  return sycl::float4{dx, dy, dz, v};
-}
-
-float sampleVolume(sycl::accessor<uchar, 1, sycl::access_mode::read> volumeAcc, uchar *data, sycl::uint3 p, sycl::uint3 gridSize) {
+// Volume samples as floats: integer voxels normalized to [0, 1] like the
+// CUDA sample's normalized-float texture, float and double voxels as they
+// are
+float voxelValue(uchar v) { return v / 255.0f; }
+float voxelValue(ushort v) { return v / 65535.0f; }
+float voxelValue(float v) { return v; }
+float voxelValue(double v) { return static_cast<float>(v); }
+
+// sample volume data set at a point
+template <class T>
+float sampleVolume(const T *volume, sycl::uint3 p, sycl::uint3 gridSize) {
   p.x() = sycl::min(p.x(), gridSize.x() - 1);
   p.y() = sycl::min(p.y(), gridSize.y() - 1);
   p.z() = sycl::min(p.z(), gridSize.z() - 1);
   uint i = (p.z() * gridSize.x() * gridSize.y()) + (p.y() * gridSize.x()) + p.x();
-  return volumeAcc[i];
+  return voxelValue(volume[i]);
+}
+
+// volume value at a grid point and the surface normal there, packed
+// (nx, ny, nz, value). The normal is the negated gradient by central
+// differences (one-sided on the border), so it points towards lower values
+// like the face normals of the CUDA sample.
+template <class T>
+sycl::float4 sampleVolume4(const T *volume, sycl::uint3 p, sycl::uint3 gridSize,
+                           sycl::float3 voxelSize) {
+  sycl::uint3 lo(sycl::max(p.x(), 1u) - 1, sycl::max(p.y(), 1u) - 1, sycl::max(p.z(), 1u) - 1);
+  sycl::uint3 hi(sycl::min(p.x() + 1, gridSize.x() - 1), sycl::min(p.y() + 1, gridSize.y() - 1),
+                 sycl::min(p.z() + 1, gridSize.z() - 1));
+  float nx = sampleVolume(volume, sycl::uint3(lo.x(), p.y(), p.z()), gridSize) -
+             sampleVolume(volume, sycl::uint3(hi.x(), p.y(), p.z()), gridSize);
+  float ny = sampleVolume(volume, sycl::uint3(p.x(), lo.y(), p.z()), gridSize) -
+             sampleVolume(volume, sycl::uint3(p.x(), hi.y(), p.z()), gridSize);
+  float nz = sampleVolume(volume, sycl::uint3(p.x(), p.y(), lo.z()), gridSize) -
+             sampleVolume(volume, sycl::uint3(p.x(), p.y(), hi.z()), gridSize);
+  return sycl::float4{nx / (sycl::max(hi.x() - lo.x(), 1u) * voxelSize.x()),
+                      ny / (sycl::max(hi.y() - lo.y(), 1u) * voxelSize.y()),
+                      nz / (sycl::max(hi.z() - lo.z(), 1u) * voxelSize.z()),
+                      sampleVolume(volume, p, gridSize)};
 }
 
-sycl::uint3 calcGridPos(uint i, sycl::uint3 gridSizeShift, sycl::uint3 gridSizeMask) {
+// grid position of voxel i for any grid size, x fastest
+sycl::uint3 calcGridPos(uint i, sycl::uint3 gridSize) {
   sycl::uint3 gridPos;
-  gridPos.x() = i & gridSizeMask.x();
-  gridPos.y() = (i >> gridSizeShift.y()) & gridSizeMask.y();
-  gridPos.z() = (i >> gridSizeShift.z()) & gridSizeMask.z();
+  gridPos.x() = i % gridSize.x();
+  gridPos.y() = (i / gridSize.x()) % gridSize.y();
+  gridPos.z() = i / (gridSize.x() * gridSize.y());
   return gridPos;
 }
 
-void classifyVoxel(uint *voxelVerts, uint *voxelOccupied, uchar *volume,
-                   sycl::uint3 gridSize, sycl::uint3 gridSizeShift,
-                   sycl::uint3 gridSizeMask, uint numVoxels,
-                   sycl::float3 voxelSize, float isoValue,
-                   sycl::accessor<uint, 1, sycl::access_mode::read> numVertsAcc,
-                   sycl::accessor<uchar, 1, sycl::access_mode::read> volumeAcc,
-                   //sycl::nd_item<3> item_ct1)
-		   sycl::id<3> idx) {
-  //uint blockId = item_ct1.get_group(1) * item_ct1.get_group_range(2) + item_ct1.get_group(2);
-  //uint i = blockId * item_ct1.get_local_range(2) + item_ct1.get_local_id(2);
-  uint i = idx[2] * gridSize.x() * gridSize.y() + idx[1] * gridSize.x() + idx[0];
-
-  sycl::uint3 gridPos = calcGridPos(i, gridSizeShift, gridSizeMask);
+uint voxelIndex(sycl::uint3 gridPos, sycl::uint3 gridSize) {
+  return (gridPos.z() * gridSize.y() + gridPos.y()) * gridSize.x() + gridPos.x();
+}
 
-  float field[8];
-  field[0] = sampleVolume(volumeAcc, volume, gridPos, gridSize);
-  field[1] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(1, 0, 0), gridSize);
-  field[2] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(1, 1, 0), gridSize);
-  field[3] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(0, 1, 0), gridSize);
-  field[4] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(0, 0, 1), gridSize);
-  field[5] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(1, 0, 1), gridSize);
-  field[6] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(1, 1, 1), gridSize);
-  field[7] = sampleVolume(volumeAcc, volume, gridPos + sycl::uint3(0, 1, 1), gridSize);
+// values at the 8 corners of the voxel at p, given by sample(grid point)
+template <class Sampler>
+void sampleCorners(Sampler sample, sycl::uint3 p, float field[8]) {
+  field[0] = sample(p);
+  field[1] = sample(p + sycl::uint3(1, 0, 0));
+  field[2] = sample(p + sycl::uint3(1, 1, 0));
+  field[3] = sample(p + sycl::uint3(0, 1, 0));
+  field[4] = sample(p + sycl::uint3(0, 0, 1));
+  field[5] = sample(p + sycl::uint3(1, 0, 1));
+  field[6] = sample(p + sycl::uint3(1, 1, 1));
+  field[7] = sample(p + sycl::uint3(0, 1, 1));
+}
 
+// marching cubes case of corner values: bit k is set when corner k lies
+// below the isovalue
+uint cubeIndex(const float field[8], float isoValue) {
   uint cubeindex;
   cubeindex = uint(field[0] < isoValue);
   cubeindex += uint(field[1] < isoValue) * 2;
@@ -113,62 +103,432 @@ void classifyVoxel(uint *voxelVerts, uint *voxelOccupied, uchar *volume,
   cubeindex += uint(field[6] < isoValue) * 64;
   cubeindex += uint(field[7] < isoValue) * 128;
 
-  uint numVerts = numVertsAcc[cubeindex];
+  return cubeindex;
+}
 
-  if (i < numVoxels) {
-    voxelVerts[i] = numVerts;
-    voxelOccupied[i] = (numVerts > 0);
-  }
+// marching cubes case of the voxel at p
+template <class Sampler>
+uint classifyCorners(Sampler sample, sycl::uint3 p, float isoValue) {
+  float field[8];
+  sampleCorners(sample, p, field);
+  return cubeIndex(field, isoValue);
+}
+
+template <class T>
+uint classifyVoxel(const T *volume, sycl::uint3 gridPos, sycl::uint3 gridSize,
+                   float isoValue) {
+  return classifyCorners(
+      [=](sycl::uint3 p) { return sampleVolume(volume, p, gridSize); }, gridPos, isoValue);
+}
+
+// Classification, both scans and compaction run as one kernel: every
+// work-group classifies a tile of SCAN_THREADS voxels, scans the tile and
+// gets the sum of all earlier tiles by decoupled look-back (Merrill and
+// Garland, "Single-pass Parallel Prefix Scan with Decoupled Look-back").
+// Occupancy and vertex count are scanned together as one 64-bit pair with
+// the occupied voxels in the high half, which holds as long as a grid
+// generates fewer than 2^32 vertices.
+typedef unsigned long long countPair;
+
+// tile status in the look-back
+enum { TILE_INVALID = 0, TILE_AGGREGATE = 1, TILE_PREFIX = 2 };
+
+// acquire loads / release stores order the tile values around the flags
+typedef sycl::atomic_ref<uint, sycl::memory_order::acq_rel, sycl::memory_scope::device,
+                         sycl::access::address_space::global_space> tileFlagRef;
+
+// Tiles are numbered in the order the work-groups start, so every tile a
+// group waits for in the look-back is already running.
+uint nextScanTile(sycl::group<1> g, uint *tileCounter) {
+  uint tile = 0;
+  if (g.get_local_linear_id() == 0)
+    tile = sycl::atomic_ref<uint, sycl::memory_order::relaxed, sycl::memory_scope::device,
+                            sycl::access::address_space::global_space>(*tileCounter)
+               .fetch_add(1u);
+  return sycl::group_broadcast(g, tile, 0);
 }
 
-extern "C" void launch_classifyVoxel(sycl::queue &q, sycl::range<3> globalRange,
-                                     uint *voxelVerts, uint *voxelOccupied, uchar *volume,
-                                     sycl::uint3 gridSize, sycl::uint3 gridSizeShift,
-                                     sycl::uint3 gridSizeMask, uint numVoxels,
-                                     sycl::float3 voxelSize, float isoValue) {
-  q.submit([&](sycl::handler &h) {
-    auto out = sycl::stream(1024, 768, h);
-    auto numVertsAcc = numVertsTableBuf -> get_access<sycl::access_mode::read>(h);
-    auto volumeAcc = volumeBuf -> get_access<sycl::access_mode::read>(h);
-    
-    //out << "voxelVerts before kernel execution:\n[";
-    //for (uint i = 0; i < numVoxels; ++i) {
-    //  out << voxelVerts[i] << " ";
-    //}
-    //out << "]\n";
-
-    h.parallel_for(globalRange, [=](sycl::id<3> idx) {
-          classifyVoxel(voxelVerts, voxelOccupied, volume, gridSize,
-                        gridSizeShift, gridSizeMask, numVoxels, voxelSize,
-                        isoValue, numVertsAcc, volumeAcc, idx);
-        });
-
-    //out << "voxelVerts after kernel execution:\n[";
-    //for (uint i = 0; i < numVoxels; ++i) {
-    //  out << voxelVerts[i] << " ";
-    //}
-    //out << "]\n";
-  }).wait();
-}
-
-void compactVoxels(uint *compactedVoxelArray, uint *voxelOccupied,
-                   uint *voxelOccupiedScan, uint numVoxels, sycl::id<3> idx) {
-  //uint blockId = item_ct1.get_group(1) * item_ct1.get_group_range(2) + item_ct1.get_group(2);
-  //uint i = blockId * item_ct1.get_local_range(2) + item_ct1.get_local_id(2);
-  uint i = idx[2] * numVoxels * numVoxels + idx[1] * numVoxels + idx[0];
-  if (i >= numVoxels) return;
-  
-  if (voxelOccupied[i]) {
-    compactedVoxelArray[voxelOccupiedScan[i]] = i;
+// Publishes the aggregate of a tile and returns the sum of all earlier
+// tiles, called by one work-item of the tile.
+countPair lookBack(uint tile, countPair aggregate, uint *tileFlags, countPair *tileAggregate,
+                   countPair *tileInclusive) {
+  countPair prefix = 0;
+  if (tile > 0) {
+    tileAggregate[tile] = aggregate;
+    tileFlagRef(tileFlags[tile]).store(TILE_AGGREGATE);
+
+    for (uint t = tile - 1;; t--) {
+      uint flag;
+      while ((flag = tileFlagRef(tileFlags[t]).load()) == TILE_INVALID) {
+      }
+      if (flag == TILE_PREFIX) {
+        prefix += tileInclusive[t];
+        break;
+      }
+      prefix += tileAggregate[t];
+    }
   }
+  tileInclusive[tile] = prefix + aggregate;
+  tileFlagRef(tileFlags[tile]).store(TILE_PREFIX);
+  return prefix;
+}
+
+uint numScanTiles = 0;
+uint *d_tileCounter = nullptr;
+uint *d_tileFlags = nullptr;
+countPair *d_tileAggregate = nullptr;
+countPair *d_tileInclusive = nullptr;
+
+extern "C" void destroyScanState(sycl::queue &q) {
+  sycl::free(d_tileCounter, q);
+  sycl::free(d_tileFlags, q);
+  sycl::free(d_tileAggregate, q);
+  sycl::free(d_tileInclusive, q);
+}
+
+// Grows the look-back state to cover numScans scans of numVoxels classified
+// voxels, one per isovalue; in sparse mode this follows the number of
+// active bricks.
+extern "C" void allocateScanState(sycl::queue &q, uint numVoxels, uint numScans) {
+  const uint numTiles = (numVoxels + SCAN_THREADS - 1) / SCAN_THREADS * numScans;
+  if (d_tileCounter && numTiles <= numScanTiles) return;
+
+  q.wait();
+  destroyScanState(q);
+  numScanTiles = sycl::max(numTiles, 1u);
+  d_tileCounter = sycl::malloc_device<uint>(1, q);
+  d_tileFlags = sycl::malloc_device<uint>(numScanTiles, q);
+  d_tileAggregate = sycl::malloc_device<countPair>(numScanTiles, q);
+  d_tileInclusive = sycl::malloc_device<countPair>(numScanTiles, q);
+}
+
+// Sparse mode first reduces every brick of BRICK_SIZE^3 voxels to the range
+// of the volume over its corners. Only bricks whose range holds the
+// isovalue can contain occupied voxels; the rest are not classified, and the
+// scan and compacted arrays are sized to the voxels of the active bricks.
+// d_brickSlot[b] is the position of active brick b in d_brickList.
+uint numBricks = 0;
+sycl::uint3 brickGrid;
+uint *d_brickList = nullptr;
+uint *d_brickSlot = nullptr;
+uint *d_brickCount = nullptr;
+
+extern "C" void allocateBrickState(sycl::queue &q, sycl::uint3 gridSize) {
+  brickGrid = (gridSize + sycl::uint3(BRICK_SIZE - 1)) / sycl::uint3(BRICK_SIZE);
+  numBricks = brickGrid.x() * brickGrid.y() * brickGrid.z();
+  d_brickList = sycl::malloc_device<uint>(numBricks, q);
+  d_brickSlot = sycl::malloc_device<uint>(numBricks, q);
+  d_brickCount = sycl::malloc_device<uint>(1, q);
+}
+
+extern "C" void destroyBrickState(sycl::queue &q) {
+  sycl::free(d_brickList, q);
+  sycl::free(d_brickSlot, q);
+  sycl::free(d_brickCount, q);
+  d_brickList = d_brickSlot = d_brickCount = nullptr;
+  numBricks = 0;
 }
 
-extern "C" void launch_compactVoxels(sycl::queue &q, sycl::range<3> globalRange,
-                                     uint *compactedVoxelArray, uint *voxelOccupied,
-                                     uint *voxelOccupiedScan, uint numVoxels) {
-  q.parallel_for(globalRange, [=](sycl::id<3> idx) {
-          compactVoxels(compactedVoxelArray, voxelOccupied, voxelOccupiedScan, numVoxels, idx);
-        }).wait();
+// In brick order a work-group classifies a slab of BRICK_SIZE x BRICK_SIZE x
+// TILE_DEPTH voxels. The values at their corners, one more grid point on
+// the high side of each axis, are read once into local memory, where each
+// one serves up to 8 voxels.
+#define TILE_DEPTH (SCAN_THREADS / (BRICK_SIZE * BRICK_SIZE))
+#define TILE_SAMPLES ((BRICK_SIZE + 1) * (BRICK_SIZE + 1) * (TILE_DEPTH + 1))
+
+static_assert(SCAN_THREADS % (BRICK_SIZE * BRICK_SIZE) == 0 && BRICK_VOXELS % SCAN_THREADS == 0,
+              "a classification tile must be whole layers of a brick");
+static_assert(MAX_ISO_LEVELS <= SCAN_THREADS, "every level needs a work-item to look back");
+
+// d_brickList and d_brickSlot listing every brick, for tiled classification
+// of the whole grid
+extern "C" void listAllBricks(sycl::queue &q) {
+  uint *brickList = d_brickList;
+  uint *brickSlot = d_brickSlot;
+  q.parallel_for(sycl::range<1>(numBricks), [=](sycl::id<1> b) {
+    brickList[b] = b;
+    brickSlot[b] = b;
+  });
+}
+
+// first voxel of a brick
+sycl::uint3 brickOrigin(uint brick, sycl::uint3 brickGrid) {
+  return calcGridPos(brick, brickGrid) * sycl::uint3(BRICK_SIZE);
+}
+
+// Position of a voxel among the classified voxels: its index in the grid, or
+// with a brick map the slot of its brick times BRICK_VOXELS plus its offset
+// in the brick.
+uint candidateIndex(sycl::uint3 gridPos, const uint *brickSlot, sycl::uint3 brickGrid,
+                    sycl::uint3 gridSize) {
+  if (!brickSlot) return voxelIndex(gridPos, gridSize);
+  const sycl::uint3 b = gridPos / sycl::uint3(BRICK_SIZE);
+  const sycl::uint3 l = gridPos % sycl::uint3(BRICK_SIZE);
+  return brickSlot[voxelIndex(b, brickGrid)] * BRICK_VOXELS +
+         voxelIndex(l, sycl::uint3(BRICK_SIZE));
+}
+
+// Lists the bricks whose range crosses one of the isovalues in d_brickList,
+// in no particular order, and returns their number. One work-group per
+// brick, each work-item reads the corners of one column of its voxels.
+// The event of the kernel goes to *kernel when given.
+template <class T>
+uint launch_findActiveBricks(sycl::queue &q, const std::vector<sycl::event> &deps,
+                             const T *volume, sycl::uint3 gridSize, IsoLevels levels,
+                             sycl::event *kernel) {
+  const sycl::uint3 bricks = brickGrid;
+  uint *brickList = d_brickList;
+  uint *brickSlot = d_brickSlot;
+  uint *brickCount = d_brickCount;
+
+  q.memset(brickCount, 0, sizeof(uint), deps);
+  sycl::event e = q.parallel_for(
+      sycl::nd_range<1>(numBricks * BRICK_SIZE * BRICK_SIZE, BRICK_SIZE * BRICK_SIZE),
+      [=](sycl::nd_item<1> item) {
+    auto g = item.get_group();
+    const uint brick = g.get_group_id(0);
+    const uint lid = item.get_local_id(0);
+    const sycl::uint3 p =
+        brickOrigin(brick, bricks) + sycl::uint3(lid % BRICK_SIZE, lid / BRICK_SIZE, 0);
+
+    float lo = FLT_MAX, hi = -FLT_MAX;
+    if (p.x() < gridSize.x() && p.y() < gridSize.y()) {
+      for (uint z = 0; z <= BRICK_SIZE; z++)
+        for (uint y = 0; y <= 1; y++)
+          for (uint x = 0; x <= 1; x++) {
+            const float v = sampleVolume(volume, p + sycl::uint3(x, y, z), gridSize);
+            lo = sycl::min(lo, v);
+            hi = sycl::max(hi, v);
+          }
+    }
+    lo = sycl::reduce_over_group(g, lo, sycl::minimum<float>());
+    hi = sycl::reduce_over_group(g, hi, sycl::maximum<float>());
+
+    // same test as a voxel with some corners below and some not
+    bool active = false;
+    for (uint l = 0; l < levels.count; l++)
+      active |= lo < levels.value[l] && hi >= levels.value[l];
+    if (lid == 0 && active) {
+      const uint slot =
+          sycl::atomic_ref<uint, sycl::memory_order::relaxed, sycl::memory_scope::device,
+                           sycl::access::address_space::global_space>(*brickCount)
+              .fetch_add(1u);
+      brickList[slot] = brick;
+      brickSlot[brick] = slot;
+    }
+  });
+
+  if (kernel) *kernel = e;
+  uint activeBricks;
+  q.memcpy(&activeBricks, brickCount, sizeof(uint)).wait();
+  return activeBricks;
+}
+
+template <class T>
+uint launch_findActiveBricks(sycl::queue &q, const std::vector<sycl::event> &deps,
+                             const T *volume, sycl::uint3 gridSize, float isoValue,
+                             sycl::event *kernel) {
+  IsoLevels levels;
+  levels.count = 1;
+  levels.value[0] = isoValue;
+  return launch_findActiveBricks(q, deps, volume, gridSize, levels, kernel);
+}
+
+// Writes compactedVoxelArray[k] (the k-th occupied voxel), compactedCubeIndex[k]
+// (its case), numVertsScanned[k] (its first output vertex) and
+// totals = {activeVoxels, totalVerts}. The kernel does not start before deps,
+// e.g. the upload of the volume, have completed.
+// Without a brick list numVoxels is the whole grid, visited in index order.
+// With one it is activeBricks * BRICK_VOXELS, visited brick by brick in
+// tiles classified from local memory.
+// candidateSlot, when given, maps the candidateIndex of every occupied voxel
+// to its compacted position. Returns the event of the kernel.
+template <class T>
+sycl::event launch_classifyCompactVoxels(sycl::queue &q, const std::vector<sycl::event> &deps,
+                                  uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                  uint *numVertsScanned, uint *candidateSlot, uint *totals,
+                                  const T *volume, uint *numVertsTable, const uint *brickList,
+                                  sycl::uint3 gridSize, uint numVoxels, float isoValue) {
+  const uint numTiles = (numVoxels + SCAN_THREADS - 1) / SCAN_THREADS;
+  const sycl::uint3 bricks = brickGrid;
+  uint *tileCounter = d_tileCounter;
+  uint *tileFlags = d_tileFlags;
+  countPair *tileAggregate = d_tileAggregate;
+  countPair *tileInclusive = d_tileInclusive;
+
+  q.memset(tileCounter, 0, sizeof(uint), deps);
+  q.memset(tileFlags, 0, numTiles * sizeof(uint));
+
+  return q.submit([&](sycl::handler &cgh) {
+    sycl::local_accessor<float, 1> tileValues(sycl::range<1>(TILE_SAMPLES), cgh);
+
+    cgh.parallel_for(sycl::nd_range<1>(numTiles * SCAN_THREADS, SCAN_THREADS),
+                     [=](sycl::nd_item<1> item) {
+      auto g = item.get_group();
+      const uint lid = item.get_local_id(0);
+      const uint tile = nextScanTile(g, tileCounter);
+
+      const uint k = tile * SCAN_THREADS + lid;
+      uint i = k, cubeindex = 0, numVerts = 0;
+      if (brickList) {
+        // numVoxels is a whole number of bricks, so every tile is full
+        const sycl::uint3 tileSize(BRICK_SIZE, BRICK_SIZE, TILE_DEPTH);
+        const sycl::uint3 sampleSize(BRICK_SIZE + 1, BRICK_SIZE + 1, TILE_DEPTH + 1);
+        const sycl::uint3 tileOrigin =
+            brickOrigin(brickList[k / BRICK_VOXELS], bricks) +
+            sycl::uint3(0, 0, (tile % (BRICK_VOXELS / SCAN_THREADS)) * TILE_DEPTH);
+
+        for (uint s = lid; s < TILE_SAMPLES; s += SCAN_THREADS)
+          tileValues[s] = sampleVolume(volume, tileOrigin + calcGridPos(s, sampleSize), gridSize);
+        sycl::group_barrier(g);
+
+        const sycl::uint3 local = calcGridPos(lid, tileSize);
+        const sycl::uint3 gridPos = tileOrigin + local;
+        i = voxelIndex(gridPos, gridSize);
+        // bricks overhang grids that are not a multiple of BRICK_SIZE
+        if (gridPos.x() < gridSize.x() && gridPos.y() < gridSize.y() &&
+            gridPos.z() < gridSize.z()) {
+          cubeindex = classifyCorners(
+              [&](sycl::uint3 p) { return tileValues[voxelIndex(p, sampleSize)]; }, local,
+              isoValue);
+          numVerts = numVertsTable[cubeindex];
+        }
+      } else if (k < numVoxels) {
+        cubeindex = classifyVoxel(volume, calcGridPos(i, gridSize), gridSize, isoValue);
+        numVerts = numVertsTable[cubeindex];
+      }
+
+      const countPair count = (countPair(numVerts > 0) << 32) | numVerts;
+      const countPair offset = sycl::exclusive_scan_over_group(g, count, sycl::plus<countPair>());
+      const countPair aggregate = sycl::reduce_over_group(g, count, sycl::plus<countPair>());
+
+      countPair prefix = 0;
+      if (lid == 0) {
+        prefix = lookBack(tile, aggregate, tileFlags, tileAggregate, tileInclusive);
+        if (tile == numTiles - 1) {
+          totals[0] = uint((prefix + aggregate) >> 32);
+          totals[1] = uint(prefix + aggregate);
+        }
+      }
+      prefix = sycl::group_broadcast(g, prefix, 0);
+
+      if (numVerts > 0) {
+        const countPair base = prefix + offset;
+        compactedVoxelArray[uint(base >> 32)] = i;
+        compactedCubeIndex[uint(base >> 32)] = uchar(cubeindex);
+        numVertsScanned[uint(base >> 32)] = uint(base);
+        if (candidateSlot) candidateSlot[k] = uint(base >> 32);
+      }
+    });
+  });
+}
+
+// Several isovalues at once: every voxel reads its corners once and is
+// classified against each level. Each level gets its own occupancy and
+// vertex count scan, looked back by work-item l of the tile for level l in
+// its own part of the look-back state.
+// The compacted arrays hold one entry per occupied (voxel, level), voxel by
+// voxel and then by level, with compactedLevel[k] the level of entry k and
+// numVertsScanned[k] its first vertex among those of its level; an entry's
+// position is the sum of its occupancy prefix over all levels.
+// totals[2 l] and totals[2 l + 1] are the occupied voxels and vertices of
+// level l. Entries beyond capacity are not written, so the caller checks the
+// sum of the occupied voxels against it.
+template <class T>
+sycl::event launch_classifyCompactLevels(sycl::queue &q, const std::vector<sycl::event> &deps,
+                                  uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                  uchar *compactedLevel, uint *numVertsScanned, uint *totals,
+                                  const T *volume, uint *numVertsTable, const uint *brickList,
+                                  sycl::uint3 gridSize, uint numVoxels, uint capacity,
+                                  IsoLevels levels) {
+  const uint numTiles = (numVoxels + SCAN_THREADS - 1) / SCAN_THREADS;
+  const sycl::uint3 bricks = brickGrid;
+  uint *tileCounter = d_tileCounter;
+  uint *tileFlags = d_tileFlags;
+  countPair *tileAggregate = d_tileAggregate;
+  countPair *tileInclusive = d_tileInclusive;
+
+  q.memset(tileCounter, 0, sizeof(uint), deps);
+  q.memset(tileFlags, 0, levels.count * numTiles * sizeof(uint));
+
+  return q.submit([&](sycl::handler &cgh) {
+    sycl::local_accessor<float, 1> tileValues(sycl::range<1>(TILE_SAMPLES), cgh);
+
+    cgh.parallel_for(sycl::nd_range<1>(numTiles * SCAN_THREADS, SCAN_THREADS),
+                     [=](sycl::nd_item<1> item) {
+      auto g = item.get_group();
+      const uint lid = item.get_local_id(0);
+      const uint tile = nextScanTile(g, tileCounter);
+
+      const uint k = tile * SCAN_THREADS + lid;
+      uint i = k;
+      bool inside = false;
+      float field[8];
+      if (brickList) {
+        const sycl::uint3 tileSize(BRICK_SIZE, BRICK_SIZE, TILE_DEPTH);
+        const sycl::uint3 sampleSize(BRICK_SIZE + 1, BRICK_SIZE + 1, TILE_DEPTH + 1);
+        const sycl::uint3 tileOrigin =
+            brickOrigin(brickList[k / BRICK_VOXELS], bricks) +
+            sycl::uint3(0, 0, (tile % (BRICK_VOXELS / SCAN_THREADS)) * TILE_DEPTH);
+
+        for (uint s = lid; s < TILE_SAMPLES; s += SCAN_THREADS)
+          tileValues[s] = sampleVolume(volume, tileOrigin + calcGridPos(s, sampleSize), gridSize);
+        sycl::group_barrier(g);
+
+        const sycl::uint3 local = calcGridPos(lid, tileSize);
+        const sycl::uint3 gridPos = tileOrigin + local;
+        i = voxelIndex(gridPos, gridSize);
+        inside = gridPos.x() < gridSize.x() && gridPos.y() < gridSize.y() &&
+                 gridPos.z() < gridSize.z();
+        if (inside)
+          sampleCorners([&](sycl::uint3 p) { return tileValues[voxelIndex(p, sampleSize)]; },
+                        local, field);
+      } else if (k < numVoxels) {
+        inside = true;
+        sampleCorners([=](sycl::uint3 p) { return sampleVolume(volume, p, gridSize); },
+                      calcGridPos(i, gridSize), field);
+      }
+
+      uchar cubeindex[MAX_ISO_LEVELS];
+      countPair base[MAX_ISO_LEVELS];
+      countPair aggregate = 0;
+      for (uint l = 0; l < levels.count; l++) {
+        cubeindex[l] = inside ? uchar(cubeIndex(field, levels.value[l])) : 0;
+        const uint numVerts = numVertsTable[cubeindex[l]];
+        const countPair count = (countPair(numVerts > 0) << 32) | numVerts;
+        base[l] = sycl::exclusive_scan_over_group(g, count, sycl::plus<countPair>());
+        const countPair sum = sycl::reduce_over_group(g, count, sycl::plus<countPair>());
+        if (lid == l) aggregate = sum;
+      }
+
+      countPair prefix = 0;
+      if (lid < levels.count) {
+        prefix = lookBack(tile, aggregate, tileFlags + lid * numTiles,
+                          tileAggregate + lid * numTiles, tileInclusive + lid * numTiles);
+        if (tile == numTiles - 1) {
+          totals[2 * lid] = uint((prefix + aggregate) >> 32);
+          totals[2 * lid + 1] = uint(prefix + aggregate);
+        }
+      }
+
+      uint entry = 0;
+      for (uint l = 0; l < levels.count; l++) {
+        base[l] += sycl::group_broadcast(g, prefix, l);
+        entry += uint(base[l] >> 32);
+      }
+
+      for (uint l = 0; l < levels.count; l++) {
+        if (numVertsTable[cubeindex[l]] == 0) continue;
+        if (entry < capacity) {
+          compactedVoxelArray[entry] = i;
+          compactedCubeIndex[entry] = cubeindex[l];
+          compactedLevel[entry] = uchar(l);
+          numVertsScanned[entry] = uint(base[l]);
+        }
+        entry++;
+      }
+    });
+  });
 }
 
 sycl::float3 vertexInterp(float isolevel, sycl::float3 p0, sycl::float3 p1, float f0, float f1) {
@@ -184,24 +544,12 @@ void vertexInterp2(float isolevel, sycl::float3 p0, sycl::float3 p1, sycl::float
   n.z() = f0.z() + t * (f1.z() - f0.z());
 }
 
-void generateTriangles(sycl::float4 *pos, sycl::float4 *norm, uint *compactedVoxelArray,
-                       uint *numVertsScanned, sycl::uint3 gridSize,
-                       sycl::uint3 gridSizeShift, sycl::uint3 gridSizeMask,
-                       sycl::float3 voxelSize, float isoValue,
-                       uint activeVoxels, uint maxVerts,
-                       sycl::accessor<uint, 1, sycl::access_mode::read> triTableAcc,
-                       sycl::accessor<uint, 1, sycl::access_mode::read> numVertsAcc,
-                       sycl::id<3> idx) {
-  //uint blockId = item_ct1.get_group(1) * item_ct1.get_group_range(2) + item_ct1.get_group(2);
-  //uint i = blockId * item_ct1.get_local_range(2) + item_ct1.get_local_id(2);
-  uint i = idx[2] * gridSize.x() * gridSize.y() + idx[1] * gridSize.x() + idx[0];
-	
-  if (i >= activeVoxels) return;
-
-  uint voxel = compactedVoxelArray[i];
-
-  sycl::uint3 gridPos = calcGridPos(voxel, gridSizeShift, gridSizeMask);
-
+// Vertex and normal on the 12 edges of the voxel at gridPos, interpolated
+// from the corner values and normals of the volume
+template <class T>
+void voxelEdgeVertices(const T *volume, sycl::uint3 gridPos, sycl::uint3 gridSize,
+                       sycl::float3 voxelSize, float isoValue, sycl::float3 vertlist[12],
+                       sycl::float3 normlist[12]) {
   sycl::float3 p;
   p.x() = -1.0f + (gridPos.x() * voxelSize.x());
   p.y() = -1.0f + (gridPos.y() * voxelSize.y());
@@ -218,27 +566,14 @@ void generateTriangles(sycl::float4 *pos, sycl::float4 *norm, uint *compactedVox
   v[7] = p + sycl::float3(0, voxelSize.y(), voxelSize.z());
 
   sycl::float4 field[8];
-  field[0] = fieldFunc4(v[0]);
-  field[1] = fieldFunc4(v[1]);
-  field[2] = fieldFunc4(v[2]);
-  field[3] = fieldFunc4(v[3]);
-  field[4] = fieldFunc4(v[4]);
-  field[5] = fieldFunc4(v[5]);
-  field[6] = fieldFunc4(v[6]);
-  field[7] = fieldFunc4(v[7]);
-
-  uint cubeindex;
-  cubeindex = uint(field[0].w() < isoValue);
-  cubeindex += uint(field[1].w() < isoValue) * 2;
-  cubeindex += uint(field[2].w() < isoValue) * 4;
-  cubeindex += uint(field[3].w() < isoValue) * 8;
-  cubeindex += uint(field[4].w() < isoValue) * 16;
-  cubeindex += uint(field[5].w() < isoValue) * 32;
-  cubeindex += uint(field[6].w() < isoValue) * 64;
-  cubeindex += uint(field[7].w() < isoValue) * 128;
-
-  sycl::float3 vertlist[12];
-  sycl::float3 normlist[12];
+  field[0] = sampleVolume4(volume, gridPos, gridSize, voxelSize);
+  field[1] = sampleVolume4(volume, gridPos + sycl::uint3(1, 0, 0), gridSize, voxelSize);
+  field[2] = sampleVolume4(volume, gridPos + sycl::uint3(1, 1, 0), gridSize, voxelSize);
+  field[3] = sampleVolume4(volume, gridPos + sycl::uint3(0, 1, 0), gridSize, voxelSize);
+  field[4] = sampleVolume4(volume, gridPos + sycl::uint3(0, 0, 1), gridSize, voxelSize);
+  field[5] = sampleVolume4(volume, gridPos + sycl::uint3(1, 0, 1), gridSize, voxelSize);
+  field[6] = sampleVolume4(volume, gridPos + sycl::uint3(1, 1, 1), gridSize, voxelSize);
+  field[7] = sampleVolume4(volume, gridPos + sycl::uint3(0, 1, 1), gridSize, voxelSize);
 
   vertexInterp2(isoValue, v[0], v[1], field[0], field[1], vertlist[0], normlist[0]);
   vertexInterp2(isoValue, v[1], v[2], field[1], field[2], vertlist[1], normlist[1]);
@@ -252,44 +587,262 @@ void generateTriangles(sycl::float4 *pos, sycl::float4 *norm, uint *compactedVox
   vertexInterp2(isoValue, v[1], v[5], field[1], field[5], vertlist[9], normlist[9]);
   vertexInterp2(isoValue, v[2], v[6], field[2], field[6], vertlist[10], normlist[10]);
   vertexInterp2(isoValue, v[3], v[7], field[3], field[7], vertlist[11], normlist[11]);
+}
+
+// Triangles of one occupied voxel. The case comes from classification and
+// the corner values and normals from the volume itself.
+template <class T>
+void generateTriangles(sycl::float4 *pos, sycl::float4 *norm, const uint *compactedVoxelArray,
+                       const uchar *compactedCubeIndex, const uint *numVertsScanned,
+                       const T *volume, const uint *triTable, const uint *numVertsTable,
+                       sycl::uint3 gridSize, sycl::float3 voxelSize, float isoValue,
+                       uint activeVoxels, uint i) {
+  if (i >= activeVoxels) return;
+
+  uint voxel = compactedVoxelArray[i];
+  uint cubeindex = compactedCubeIndex[i];
 
-  uint numVerts = numVertsAcc[cubeindex];
+  sycl::uint3 gridPos = calcGridPos(voxel, gridSize);
 
-  for (int i = 0; i < numVerts; i++) {
-    uint edge = triTableAcc[cubeindex * 16 + i];
+  sycl::float3 vertlist[12];
+  sycl::float3 normlist[12];
+  voxelEdgeVertices(volume, gridPos, gridSize, voxelSize, isoValue, vertlist, normlist);
+
+  uint numVerts = numVertsTable[cubeindex];
 
-    uint index = numVertsScanned[voxel] + i;
+  for (uint j = 0; j < numVerts; j++) {
+    uint edge = triTable[cubeindex * 16 + j];
 
-    if (index < maxVerts) {
-      pos[index] = sycl::float4{vertlist[edge].x(), vertlist[edge].y(), vertlist[edge].z(), 1.0f};
-      norm[index] = sycl::float4{normlist[edge].x(), normlist[edge].y(), normlist[edge].z(), 0.0f};
+    uint index = numVertsScanned[i] + j;
+
+    pos[index] = sycl::float4{vertlist[edge].x(), vertlist[edge].y(), vertlist[edge].z(), 1.0f};
+    norm[index] = sycl::float4{normlist[edge].x(), normlist[edge].y(), normlist[edge].z(), 0.0f};
+  }
+}
+
+// Returns the event of the kernel, so copies of the triangles on another
+// queue can depend on it.
+template <class T>
+sycl::event launch_generateTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                     uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                     uint *numVertsScanned, const T *volume,
+                                     uint *triTable, uint *numVertsTable,
+                                     sycl::uint3 gridSize, sycl::float3 voxelSize,
+                                     float isoValue, uint activeVoxels) {
+  // one work-item per occupied voxel, rounded up to whole work-groups
+  const size_t global = ((activeVoxels + NTHREADS - 1) / NTHREADS) * NTHREADS;
+  return q.parallel_for(sycl::nd_range<1>(global, NTHREADS), [=](sycl::nd_item<1> item) {
+    generateTriangles(pos, norm, compactedVoxelArray, compactedCubeIndex, numVertsScanned,
+                      volume, triTable, numVertsTable, gridSize, voxelSize, isoValue,
+                      activeVoxels, item.get_global_id(0));
+  });
+}
+
+// Triangles of all levels in one launch over the entries of
+// launch_classifyCompactLevels. The vertices of level l follow those of the
+// levels before it, so every level's mesh is a contiguous range.
+template <class T>
+sycl::event launch_generateLevelTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                          uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                          uchar *compactedLevel, uint *numVertsScanned,
+                                          uint *totals, const T *volume, uint *triTable,
+                                          uint *numVertsTable, sycl::uint3 gridSize,
+                                          sycl::float3 voxelSize, IsoLevels levels,
+                                          uint numEntries) {
+  const size_t global = ((numEntries + NTHREADS - 1) / NTHREADS) * NTHREADS;
+  return q.parallel_for(sycl::nd_range<1>(global, NTHREADS), [=](sycl::nd_item<1> item) {
+    const uint i = item.get_global_id(0);
+    if (i >= numEntries) return;
+
+    const uint level = compactedLevel[i];
+    uint first = numVertsScanned[i];
+    for (uint l = 0; l < level; l++) first += totals[2 * l + 1];
+
+    const uint cubeindex = compactedCubeIndex[i];
+    sycl::float3 vertlist[12];
+    sycl::float3 normlist[12];
+    voxelEdgeVertices(volume, calcGridPos(compactedVoxelArray[i], gridSize), gridSize,
+                      voxelSize, levels.value[level], vertlist, normlist);
+
+    const uint numVerts = numVertsTable[cubeindex];
+    for (uint j = 0; j < numVerts; j++) {
+      const uint edge = triTable[cubeindex * 16 + j];
+      pos[first + j] = sycl::float4{vertlist[edge].x(), vertlist[edge].y(), vertlist[edge].z(), 1.0f};
+      norm[first + j] = sycl::float4{normlist[edge].x(), normlist[edge].y(), normlist[edge].z(), 0.0f};
     }
+  });
+}
+
+// Indexed meshes store every vertex once. A vertex lies on an edge between
+// two grid points, and edges are shared by up to four voxels; the edge
+// belongs to the voxel it starts from, where it is edge 0, 3 or 8 (along x,
+// y or z from corner 0). Edge e of a voxel starts from the voxel at offset
+// (bit 0: x, bit 1: y, bit 2: z) (EDGE_OWNER_OFFSETS >> 3e) & 7.
+#define EDGE_OWNER_OFFSETS 0x4c89ac088ull
+
+sycl::uint3 edgeOwnerOffset(uint edge) {
+  const uint o = uint(EDGE_OWNER_OFFSETS >> (3 * edge)) & 7;
+  return sycl::uint3(o & 1, (o >> 1) & 1, o >> 2);
+}
+
+// the edge with the same end points in the owning voxel
+uint edgeInOwner(uint edge) { return edge >= 8 ? 8 : (edge & 1) * 3; }
+
+// Edges whose vertex the voxel at gridPos stores: its crossed edges that
+// start from it, and those whose owner would lie outside the grid.
+uint ownedEdges(uint edges, sycl::uint3 gridPos, sycl::uint3 gridSize) {
+  uint owned = 0;
+  for (uint e = 0; e < 12; e++) {
+    const sycl::uint3 owner = gridPos + edgeOwnerOffset(e);
+    if (edgeInOwner(e) == e || owner.x() >= gridSize.x() || owner.y() >= gridSize.y() ||
+        owner.z() >= gridSize.z())
+      owned |= 1u << e;
   }
+  return edges & owned;
 }
 
-extern "C" void launch_generateTriangles(sycl::queue &q, sycl::range<3> globalRange,
-                                         sycl::float4 *pos, sycl::float4 *norm, 
-					 uint *compactedVoxelArray, uint *numVertsScanned, 
-					 sycl::uint3 gridSize, sycl::uint3 gridSizeShift,
-                                         sycl::uint3 gridSizeMask, sycl::float3 voxelSize,
-					 float isoValue, uint activeVoxels, uint maxVerts) {
-  q.submit([&](sycl::handler &h) {
-    auto triTableAcc = triTableBuf->get_access<sycl::access_mode::read>(h);
-    auto numVertsAcc = numVertsTableBuf->get_access<sycl::access_mode::read>(h);
+// position of the vertex of an owned edge among the voxel's stored vertices
+uint ownedRank(uint owned, uint edge) { return sycl::popcount(owned & ((1u << edge) - 1)); }
+
+// Scans the number of vertices each occupied voxel stores into
+// vertexBase[i] and writes the total to totals[2], with the look-back of
+// the classification kernel.
+sycl::event launch_scanMeshVertices(sycl::queue &q, uint *vertexBase, uint *totals,
+                             uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                             uint *edgeTable, sycl::uint3 gridSize, uint activeVoxels) {
+  const uint numTiles = (activeVoxels + SCAN_THREADS - 1) / SCAN_THREADS;
+  uint *tileCounter = d_tileCounter;
+  uint *tileFlags = d_tileFlags;
+  countPair *tileAggregate = d_tileAggregate;
+  countPair *tileInclusive = d_tileInclusive;
+
+  q.memset(tileCounter, 0, sizeof(uint));
+  q.memset(tileFlags, 0, numTiles * sizeof(uint));
+
+  return q.parallel_for(sycl::nd_range<1>(numTiles * SCAN_THREADS, SCAN_THREADS),
+                 [=](sycl::nd_item<1> item) {
+    auto g = item.get_group();
+    const uint lid = item.get_local_id(0);
+    const uint tile = nextScanTile(g, tileCounter);
+
+    const uint i = tile * SCAN_THREADS + lid;
+    countPair count = 0;
+    if (i < activeVoxels)
+      count = sycl::popcount(ownedEdges(edgeTable[compactedCubeIndex[i]],
+                                        calcGridPos(compactedVoxelArray[i], gridSize),
+                                        gridSize));
+
+    const countPair offset = sycl::exclusive_scan_over_group(g, count, sycl::plus<countPair>());
+    const countPair aggregate = sycl::reduce_over_group(g, count, sycl::plus<countPair>());
+
+    countPair prefix = 0;
+    if (lid == 0) {
+      prefix = lookBack(tile, aggregate, tileFlags, tileAggregate, tileInclusive);
+      if (tile == numTiles - 1) totals[2] = uint(prefix + aggregate);
+    }
+    prefix = sycl::group_broadcast(g, prefix, 0);
 
-    h.parallel_for(globalRange, [=](sycl::id<3> idx) {
-          generateTriangles(pos, norm, compactedVoxelArray, numVertsScanned,
-                            gridSize, gridSizeShift, gridSizeMask, voxelSize,
-                            isoValue, activeVoxels, maxVerts, triTableAcc,
-                            numVertsAcc, idx);
-        });
-  }).wait();
+    if (i < activeVoxels) vertexBase[i] = uint(prefix + offset);
+  });
 }
 
-extern "C" void ThrustScanWrapper(unsigned int *output, unsigned int *input,
-                                  unsigned int numElements) {
-	oneapi::dpl::exclusive_scan(oneapi::dpl::execution::dpcpp_default, input, input + numElements, output, 0);
+// Indexed triangles of one occupied voxel: its own vertices go to
+// vertexBase[i] on, and every triangle corner refers to the vertex of the
+// voxel owning that edge, found through candidateSlot.
+template <class T>
+void generateIndexedTriangles(sycl::float4 *pos, sycl::float4 *norm, uint *indices,
+                              const uint *compactedVoxelArray, const uchar *compactedCubeIndex,
+                              const uint *numVertsScanned, const uint *vertexBase,
+                              const uint *candidateSlot, const uint *brickSlot,
+                              sycl::uint3 brickGrid, const T *volume, const uint *triTable,
+                              const uint *numVertsTable, const uint *edgeTable,
+                              sycl::uint3 gridSize, sycl::float3 voxelSize, float isoValue,
+                              uint activeVoxels, uint i) {
+  if (i >= activeVoxels) return;
+
+  const uint cubeindex = compactedCubeIndex[i];
+  const sycl::uint3 gridPos = calcGridPos(compactedVoxelArray[i], gridSize);
+  const uint owned = ownedEdges(edgeTable[cubeindex], gridPos, gridSize);
+
+  sycl::float3 vertlist[12];
+  sycl::float3 normlist[12];
+  voxelEdgeVertices(volume, gridPos, gridSize, voxelSize, isoValue, vertlist, normlist);
+
+  uint index = vertexBase[i];
+  for (uint e = 0; e < 12; e++) {
+    if (owned & (1u << e)) {
+      pos[index] = sycl::float4{vertlist[e].x(), vertlist[e].y(), vertlist[e].z(), 1.0f};
+      norm[index] = sycl::float4{normlist[e].x(), normlist[e].y(), normlist[e].z(), 0.0f};
+      index++;
+    }
+  }
+
+  const uint numVerts = numVertsTable[cubeindex];
+  for (uint j = 0; j < numVerts; j++) {
+    const uint edge = triTable[cubeindex * 16 + j];
+    uint vertex;
+    if (owned & (1u << edge)) {
+      vertex = vertexBase[i] + ownedRank(owned, edge);
+    } else {
+      const sycl::uint3 ownerPos = gridPos + edgeOwnerOffset(edge);
+      const uint o = candidateSlot[candidateIndex(ownerPos, brickSlot, brickGrid, gridSize)];
+      vertex = vertexBase[o] +
+               ownedRank(ownedEdges(edgeTable[compactedCubeIndex[o]], ownerPos, gridSize),
+                         edgeInOwner(edge));
+    }
+    indices[numVertsScanned[i] + j] = vertex;
+  }
 }
 
-#endif
+template <class T>
+sycl::event launch_generateIndexedTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                            uint *indices, uint *compactedVoxelArray,
+                                            uchar *compactedCubeIndex, uint *numVertsScanned,
+                                            uint *vertexBase, uint *candidateSlot,
+                                            bool sparse, const T *volume, uint *triTable,
+                                            uint *numVertsTable, uint *edgeTable,
+                                            sycl::uint3 gridSize, sycl::float3 voxelSize,
+                                            float isoValue, uint activeVoxels) {
+  const uint *brickSlot = sparse ? d_brickSlot : nullptr;
+  const sycl::uint3 bricks = brickGrid;
+  const size_t global = ((activeVoxels + NTHREADS - 1) / NTHREADS) * NTHREADS;
+  return q.parallel_for(sycl::nd_range<1>(global, NTHREADS), [=](sycl::nd_item<1> item) {
+    generateIndexedTriangles(pos, norm, indices, compactedVoxelArray, compactedCubeIndex,
+                             numVertsScanned, vertexBase, candidateSlot, brickSlot, bricks,
+                             volume, triTable, numVertsTable, edgeTable, gridSize, voxelSize,
+                             isoValue, activeVoxels, item.get_global_id(0));
+  });
+}
 
+// the host code picks one of these by the -type of the volume; double volumes
+// are electron densities handed over by 02-electrondensity
+#define INSTANTIATE_VOLUME_TYPE(T)                                                           \
+  template uint launch_findActiveBricks<T>(sycl::queue &, const std::vector<sycl::event> &,  \
+                                           const T *, sycl::uint3, float, sycl::event *);    \
+  template uint launch_findActiveBricks<T>(sycl::queue &, const std::vector<sycl::event> &,  \
+                                           const T *, sycl::uint3, IsoLevels,                \
+                                           sycl::event *);                                   \
+  template sycl::event launch_classifyCompactVoxels<T>(                                      \
+      sycl::queue &, const std::vector<sycl::event> &, uint *, uchar *, uint *, uint *,      \
+      uint *, const T *, uint *, const uint *, sycl::uint3, uint, float);                    \
+  template sycl::event launch_generateTriangles<T>(sycl::queue &, sycl::float4 *,            \
+                                                   sycl::float4 *, uint *, uchar *, uint *,  \
+                                                   const T *, uint *, uint *, sycl::uint3,   \
+                                                   sycl::float3, float, uint);               \
+  template sycl::event launch_classifyCompactLevels<T>(                                      \
+      sycl::queue &, const std::vector<sycl::event> &, uint *, uchar *, uchar *, uint *,     \
+      uint *, const T *, uint *, const uint *, sycl::uint3, uint, uint, IsoLevels);          \
+  template sycl::event launch_generateLevelTriangles<T>(                                     \
+      sycl::queue &, sycl::float4 *, sycl::float4 *, uint *, uchar *, uchar *, uint *,       \
+      uint *, const T *, uint *, uint *, sycl::uint3, sycl::float3, IsoLevels, uint);        \
+  template sycl::event launch_generateIndexedTriangles<T>(                                   \
+      sycl::queue &, sycl::float4 *, sycl::float4 *, uint *, uint *, uchar *, uint *,        \
+      uint *, uint *, bool, const T *, uint *, uint *, uint *, sycl::uint3, sycl::float3,    \
+      float, uint);
+
+INSTANTIATE_VOLUME_TYPE(uchar)
+INSTANTIATE_VOLUME_TYPE(ushort)
+INSTANTIATE_VOLUME_TYPE(float)
+INSTANTIATE_VOLUME_TYPE(double)
+
+#endif
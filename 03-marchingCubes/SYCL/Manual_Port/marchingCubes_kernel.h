@@ -0,0 +1,89 @@
+#ifndef _MARCHING_CUBES_KERNEL_H_
+#define _MARCHING_CUBES_KERNEL_H_
+
+// Launchers of marchingCubes_kernel.cpp. Besides the sample itself they are
+// used by other programs that already hold a volume in device memory, e.g.
+// the electron density of 02-electrondensity.
+//
+// Volumes are stored x fastest. All launchers of an extraction must use the
+// same in-order queue. For profiling on a queue with enable_profiling the
+// launchers return the event of their main kernel; launch_findActiveBricks,
+// which waits for its count, stores it in *kernel.
+
+#include <sycl/sycl.hpp>
+#include <vector>
+
+#include "defines.h"
+
+// Isovalues of a multi-level extraction, passed to the kernels by value
+struct IsoLevels {
+  uint count;
+  float value[MAX_ISO_LEVELS];
+};
+
+// The kernels are instantiated for uchar, ushort, float and double volumes.
+template <class T>
+sycl::event launch_classifyCompactVoxels(sycl::queue &q, const std::vector<sycl::event> &deps,
+                                  uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                  uint *numVertsScanned, uint *candidateSlot, uint *totals,
+                                  const T *volume, uint *numVertsTable, const uint *brickList,
+                                  sycl::uint3 gridSize, uint numVoxels, float isoValue);
+template <class T>
+uint launch_findActiveBricks(sycl::queue &q, const std::vector<sycl::event> &deps,
+                             const T *volume, sycl::uint3 gridSize, float isoValue,
+                             sycl::event *kernel = nullptr);
+template <class T>
+uint launch_findActiveBricks(sycl::queue &q, const std::vector<sycl::event> &deps,
+                             const T *volume, sycl::uint3 gridSize, IsoLevels levels,
+                             sycl::event *kernel = nullptr);
+template <class T>
+sycl::event launch_classifyCompactLevels(sycl::queue &q, const std::vector<sycl::event> &deps,
+                                  uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                  uchar *compactedLevel, uint *numVertsScanned, uint *totals,
+                                  const T *volume, uint *numVertsTable, const uint *brickList,
+                                  sycl::uint3 gridSize, uint numVoxels, uint capacity,
+                                  IsoLevels levels);
+
+template <class T>
+sycl::event launch_generateTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                     uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                     uint *numVertsScanned, const T *volume,
+                                     uint *triTable, uint *numVertsTable,
+                                     sycl::uint3 gridSize, sycl::float3 voxelSize,
+                                     float isoValue, uint activeVoxels);
+template <class T>
+sycl::event launch_generateLevelTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                          uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                                          uchar *compactedLevel, uint *numVertsScanned,
+                                          uint *totals, const T *volume, uint *triTable,
+                                          uint *numVertsTable, sycl::uint3 gridSize,
+                                          sycl::float3 voxelSize, IsoLevels levels,
+                                          uint numEntries);
+
+sycl::event launch_scanMeshVertices(sycl::queue &q, uint *vertexBase, uint *totals,
+                             uint *compactedVoxelArray, uchar *compactedCubeIndex,
+                             uint *edgeTable, sycl::uint3 gridSize, uint activeVoxels);
+
+template <class T>
+sycl::event launch_generateIndexedTriangles(sycl::queue &q, sycl::float4 *pos, sycl::float4 *norm,
+                                            uint *indices, uint *compactedVoxelArray,
+                                            uchar *compactedCubeIndex, uint *numVertsScanned,
+                                            uint *vertexBase, uint *candidateSlot,
+                                            bool sparse, const T *volume, uint *triTable,
+                                            uint *numVertsTable, uint *edgeTable,
+                                            sycl::uint3 gridSize, sycl::float3 voxelSize,
+                                            float isoValue, uint activeVoxels);
+
+extern "C" void allocateTextures(sycl::queue &q, uint **d_edgeTable, uint **d_triTable,
+                                 uint **d_numVertsTable);
+extern "C" void allocateScanState(sycl::queue &q, uint numVoxels, uint numScans);
+extern "C" void destroyScanState(sycl::queue &q);
+extern "C" void allocateBrickState(sycl::queue &q, sycl::uint3 gridSize);
+extern "C" void destroyBrickState(sycl::queue &q);
+extern "C" void listAllBricks(sycl::queue &q);
+
+// brick state of sparse and tiled classification, one grid at a time
+extern uint numBricks;
+extern uint *d_brickList;
+
+#endif
@@ -4,11 +4,44 @@
 #include <algorithm>
 #include <queue>
 #include <random>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <CLI/CLI.hpp>
 #include <sycl/sycl.hpp>
 
-class relax_light_edges;
-class relax_heavy_edges;
+// Diagnostics compiled into the solver, chosen with -DSSSP_VERBOSITY=<n>:
+//   0 Quiet        no I/O at all inside the solver loop (default)
+//   1 Phases       bucket numbers and all distances after every phase
+//   2 Relaxations  additionally every successful relaxation, from the kernels
+enum class Verbosity { Quiet, Phases, Relaxations };
+
+#ifndef SSSP_VERBOSITY
+#define SSSP_VERBOSITY 0
+#endif
+constexpr Verbosity kVerbosity = static_cast<Verbosity>(SSSP_VERBOSITY);
+
+template <Verbosity> class relax_edges;
+template <Verbosity> class pull_light_edges;
+template <Verbosity> class begin_bucket;
+template <Verbosity> class take_bucket;
+template <Verbosity> class find_next_bucket;
+template <Verbosity> class count_buckets;
+template <Verbosity> class fill_buckets;
 
 constexpr int INF = std::numeric_limits<int>::max();
 
@@ -17,6 +50,165 @@ struct Edge {
     int src, dest, weight;
 };
 
+// Compressed sparse row adjacency. The out-edges of u are [row[u], row[u + 1]);
+// the light ones (weight <= DELTA) come first and end at light_end[u], so
+// each relaxation phase reads one contiguous slice per vertex. The light
+// in-edges of v, [in_row[v], in_row[v + 1]) of in_src and in_weight, serve
+// the pull-style light phase.
+struct CSRGraph {
+    int V = 0, E = 0;
+    int max_weight = 0;
+    std::vector<int> row;
+    std::vector<int> light_end;
+    std::vector<int> dest;
+    std::vector<int> weight;
+    std::vector<int> in_row;
+    std::vector<int> in_src;
+    std::vector<int> in_weight;
+};
+
+int num_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Run f(t) on threads t = 0 .. n - 1
+template <typename F>
+void parallel_run(int n, F f) {
+    std::vector<std::thread> threads;
+    for (int t = 1; t < n; t++) threads.emplace_back(f, t);
+    f(0);
+    for (auto& th : threads) th.join();
+}
+
+// Order the out-edges of every vertex light first and record the split,
+// then transpose the light edges into the reverse adjacency.
+void splitLightHeavy(CSRGraph& g, int DELTA) {
+    g.light_end.resize(g.V);
+    const int nt = num_threads();
+    std::unique_ptr<std::atomic<int>[]> pos(new std::atomic<int>[g.V + 1]);
+    for (int v = 0; v <= g.V; v++) pos[v] = 0;
+
+    parallel_run(nt, [&](int t) {
+        for (int u = t; u < g.V; u += nt) {
+            int lo = g.row[u], hi = g.row[u + 1];
+            while (lo < hi) {
+                if (g.weight[lo] <= DELTA) { lo++; continue; }
+                hi--;
+                std::swap(g.weight[lo], g.weight[hi]);
+                std::swap(g.dest[lo], g.dest[hi]);
+            }
+            g.light_end[u] = lo;
+            for (int i = g.row[u]; i < lo; i++) pos[g.dest[i] + 1].fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    g.in_row.resize(g.V + 1);
+    g.in_row[0] = 0;
+    for (int v = 0; v < g.V; v++) {
+        g.in_row[v + 1] = g.in_row[v] + pos[v + 1];
+        pos[v] = g.in_row[v];
+    }
+    g.in_src.resize(g.in_row[g.V]);
+    g.in_weight.resize(g.in_row[g.V]);
+
+    parallel_run(nt, [&](int t) {
+        for (int u = t; u < g.V; u += nt)
+            for (int i = g.row[u]; i < g.light_end[u]; i++) {
+                int k = pos[g.dest[i]].fetch_add(1, std::memory_order_relaxed);
+                g.in_src[k] = u;
+                g.in_weight[k] = g.weight[i];
+            }
+    });
+}
+
+// CSR from edge lists produced by several threads, without merging them
+// first: out-degrees are counted and the edges scattered in parallel.
+CSRGraph buildCSR(const std::vector<std::vector<Edge>>& parts, int V) {
+    CSRGraph g;
+    g.V = V;
+    std::vector<int> max_weight(parts.size(), 0);
+    std::unique_ptr<std::atomic<int>[]> pos(new std::atomic<int>[V + 1]);
+    for (int u = 0; u <= V; u++) pos[u] = 0;
+
+    parallel_run(parts.size(), [&](int t) {
+        for (const auto& e : parts[t]) {
+            pos[e.src + 1].fetch_add(1, std::memory_order_relaxed);
+            max_weight[t] = std::max(max_weight[t], e.weight);
+        }
+    });
+
+    g.row.resize(V + 1);
+    g.row[0] = 0;
+    for (int u = 0; u < V; u++) {
+        g.row[u + 1] = g.row[u] + pos[u + 1];
+        pos[u] = g.row[u];
+    }
+    g.E = g.row[V];
+    g.max_weight = *std::max_element(max_weight.begin(), max_weight.end());
+    g.dest.resize(g.E);
+    g.weight.resize(g.E);
+
+    parallel_run(parts.size(), [&](int t) {
+        for (const auto& e : parts[t]) {
+            int k = pos[e.src].fetch_add(1, std::memory_order_relaxed);
+            g.dest[k] = e.dest;
+            g.weight[k] = e.weight;
+        }
+    });
+    return g;
+}
+
+CSRGraph buildCSR(const std::vector<Edge>& edges, int V, int DELTA) {
+    CSRGraph g = buildCSR(std::vector<std::vector<Edge>>{edges}, V);
+    splitLightHeavy(g, DELTA);
+    return g;
+}
+
+// Bucket width from graph statistics. Meyer and Sanders show DELTA = Theta(1 / d)
+// for degree d and weights in [0, 1]; scaled to the weights at hand this is a
+// typical large weight over the average degree. The 90th percentile stands in
+// for the maximum so a few outliers do not blow up the width, and DELTA never
+// drops below the lightest edge (buckets that can not fill).
+int chooseDelta(const CSRGraph& g) {
+    if (g.E == 0) return 1;
+    // Weights are sampled so the statistics stay cheap on large graphs
+    const int step = std::max(1, g.E / 65536);
+    std::vector<int> sample;
+    for (int i = 0; i < g.E; i += step) sample.push_back(g.weight[i]);
+    std::sort(sample.begin(), sample.end());
+
+    const double degree = std::max(1.0, double(g.E) / g.V);
+    const int high = sample[sample.size() * 9 / 10];
+    int delta = int(high / degree);
+    delta = std::max(delta, sample.front());
+    return std::max(delta, 1);
+}
+
+// Device allocation of n elements (at least one) that throws instead of
+// returning nullptr when the device is out of memory.
+template <typename T>
+T* device_alloc(size_t n, sycl::queue& q) {
+    T* ptr = sycl::malloc_device<T>(std::max<size_t>(1, n), q);
+    if (!ptr)
+        throw std::runtime_error("cannot allocate " + std::to_string(std::max<size_t>(1, n) * sizeof(T)) +
+                                 " bytes on the device");
+    return ptr;
+}
+
+using atomic_int = sycl::atomic_ref<int, sycl::memory_order::relaxed, sycl::memory_scope::device,
+                                    sycl::access::address_space::global_space>;
+
+// Lower dist_v to candidate atomically, so concurrent relaxations of the same
+// target never lose an update. True if this call improved the distance.
+inline bool relax(int& dist_v, int candidate) {
+    return atomic_int(dist_v).fetch_min(candidate) > candidate;
+}
+
+// Atomic read of a distance that other work-items may be lowering.
+inline int load_distance(int& dist_u) {
+    return atomic_int(dist_u).load();
+}
+
 void print_distances(const std::vector<int>& dist) {
     for (int i = 0; i < dist.size(); ++i) {
         if (dist[i] == INF)
@@ -26,19 +218,6 @@ void print_distances(const std::vector<int>& dist) {
     }
 }
 
-void print_buckets(const std::vector<std::vector<int>>& buckets) {
-    for (int i = 0; i < buckets.size(); ++i) {
-        if (!buckets[i].empty()) {
-            std::cout << "Bucket " << i << ": ";
-            for (int v : buckets[i]) {
-                std::cout << char('A' + v) << " ";
-            }
-            std::cout << "\n";
-        }
-    }
-}
-
-
 void print_graph(const std::vector<Edge>& edges) {
     if (edges.empty()) { std::cout << "Graph is empty\n"; return; }
     for (const auto& edge : edges) {
@@ -47,150 +226,620 @@ void print_graph(const std::vector<Edge>& edges) {
     std::cout << std::endl;
 }
 
-void deltaStepping(const std::vector<Edge>& edges, int src, int V, int E, int DELTA) {
-    // Flattened graph representation -> Unable to use complex objects in vectors for kernel parallel execution 
-    std::vector<int> edge_src(E);
-    std::vector<int> edge_dest(E);
-    std::vector<int> edge_weight(E);
-    for (int i = 0; i < E; i++) {
-        edge_src[i] = edges[i].src;
-        edge_dest[i] = edges[i].dest;
-        edge_weight[i] = edges[i].weight;
+// Work-group size of the bucket kernels. Every kernel runs on a fixed grid
+// that strides over its work list and reads the list length on the device,
+// so no launch needs a count from the host.
+constexpr int WG = 256;
+
+// Slots of the device counters array
+// (SPILLED is set when an entry did not fit its bucket slot)
+enum Counter { TAKE, FRONTIER, SETTLED, NEXT, NEXT_SIZE, SPILLED, NUM_COUNTERS };
+
+// A light phase pulls over the reverse graph instead of pushing from the
+// frontier once the bucket holds more than V / PULL_RATIO entries. Pushing
+// costs the frontier's out-edges plus atomic contention on popular targets,
+// pulling every light in-edge of the unsettled vertices without contention.
+constexpr int PULL_RATIO = 16;
+
+// Launches of a run by phase of the algorithm, for event profiling.
+// PHASE_INIT covers the fills that reset the bucket state, PHASE_LAYOUT the
+// rebuilds of the bucket pool, PHASE_TRANSFER the copies between host and
+// device.
+enum Phase {
+    PHASE_INIT, PHASE_BEGIN, PHASE_TAKE, PHASE_PUSH_LIGHT, PHASE_PULL_LIGHT,
+    PHASE_RELAX_HEAVY, PHASE_NEXT_BUCKET, PHASE_LAYOUT, PHASE_TRANSFER, NUM_PHASES
+};
+const char* const phase_names[NUM_PHASES] = {"init", "begin", "take", "push_light", "pull_light",
+                                             "relax_heavy", "next_bucket", "layout", "transfer"};
+
+// Device time of a finished command on a profiling queue, in microseconds
+inline double event_us(const sycl::event& e) {
+    return 1e-3 * (e.get_profiling_info<sycl::info::event_profiling::command_end>() -
+                   e.get_profiling_info<sycl::info::event_profiling::command_start>());
+}
+
+// What the last run did: non-empty buckets, and light phases over all of
+// them (phases - buckets of them re-relaxed vertices already taken), and
+// layouts of the bucket pool. On a queue with enable_profiling also the
+// device time of every phase, summed over its launches, and the bytes
+// copied to and from the device.
+struct RunStats {
+    int buckets = 0;
+    int phases = 0;
+    int pull_phases = 0;
+    int layouts = 0;
+    bool profiled = false;
+    double phase_us[NUM_PHASES] = {};
+    size_t transfer_bytes = 0;
+};
+
+// A CSR graph uploaded once, split for DELTA, and shared by any number of
+// solvers on queues of the same context.
+class DeviceGraph {
+public:
+    DeviceGraph(sycl::queue& q, const CSRGraph& g, int DELTA);
+    ~DeviceGraph();
+    DeviceGraph(const DeviceGraph&) = delete;
+    DeviceGraph& operator=(const DeviceGraph&) = delete;
+
+    sycl::queue queue;
+    int V, E, DELTA, max_weight;
+    int* row = nullptr;
+    int* light_end = nullptr;
+    int* dest = nullptr;
+    int* weight = nullptr;
+    int* in_row = nullptr;
+    int* in_src = nullptr;
+    int* in_weight = nullptr;
+
+private:
+    void release();
+};
+
+DeviceGraph::DeviceGraph(sycl::queue& q, const CSRGraph& g, int DELTA)
+    : queue(q), V(g.V), E(g.E), DELTA(DELTA), max_weight(g.max_weight) {
+    const int E_light = g.in_row[V];
+    try {
+        row = device_alloc<int>(V + 1, queue);
+        light_end = device_alloc<int>(V, queue);
+        dest = device_alloc<int>(E, queue);
+        weight = device_alloc<int>(E, queue);
+        in_row = device_alloc<int>(V + 1, queue);
+        in_src = device_alloc<int>(E_light, queue);
+        in_weight = device_alloc<int>(E_light, queue);
+    } catch (...) {
+        release();
+        throw;
     }
 
-    std::vector<int> dist(V, INF);
-    dist[src] = 0;
+    queue.memcpy(row, g.row.data(), (V + 1) * sizeof(int));
+    queue.memcpy(light_end, g.light_end.data(), V * sizeof(int));
+    queue.memcpy(dest, g.dest.data(), E * sizeof(int));
+    queue.memcpy(weight, g.weight.data(), E * sizeof(int));
+    queue.memcpy(in_row, g.in_row.data(), (V + 1) * sizeof(int));
+    queue.memcpy(in_src, g.in_src.data(), E_light * sizeof(int));
+    queue.memcpy(in_weight, g.in_weight.data(), E_light * sizeof(int));
+    queue.wait();
+}
+
+DeviceGraph::~DeviceGraph() {
+    release();
+}
+
+void DeviceGraph::release() {
+    for (int* ptr : {row, light_end, dest, weight, in_row, in_src, in_weight})
+        if (ptr) sycl::free(ptr, queue);
+}
+
+// Delta-stepping state for one query at a time on a device graph; run() can
+// be called for any number of sources. Solvers on different queues share
+// the graph and answer independent queries concurrently.
+template <Verbosity Level = kVerbosity>
+class DeltaStepping {
+public:
+    DeltaStepping(sycl::queue& q, const DeviceGraph& g);
+    ~DeltaStepping();
+    DeltaStepping(const DeltaStepping&) = delete;
+    DeltaStepping& operator=(const DeltaStepping&) = delete;
+
+    std::vector<int> run(int src);
 
+    const RunStats& stats() const { return last; }
+    // Work-items per launch, the frontier size that fills the device
+    int parallelism() const { return stride; }
+
+private:
     sycl::queue queue;
-    std::cout << "Running on "
-              << queue.get_device().get_info<sycl::info::device::name>()
-              << "\n";
+    int V, E, DELTA, NB;
+    int stride;
+    sycl::nd_range<1> grid;
 
-    std::vector<std::vector<int>> buckets((INF / DELTA) + 1);
-    buckets[0].push_back(src);
-
-    sycl::buffer<int, 1> edge_src_buf(edge_src.data(), edge_src.size());
-    sycl::buffer<int, 1> edge_dest_buf(edge_dest.data(), edge_dest.size());
-    sycl::buffer<int, 1> edge_weight_buf(edge_weight.data(), edge_weight.size());
-    sycl::buffer<int, 1> dist_buf(dist.data(), dist.size());
-
-    auto process_light_edges = [&](std::vector<int>& bucket) {
-        sycl::buffer<int, 1> bucket_buf(bucket.data(), bucket.size());
-
-        queue.submit([&](sycl::handler& cgh) {
-            auto edge_src_acc = edge_src_buf.get_access<sycl::access::mode::read>(cgh);
-            auto edge_dest_acc = edge_dest_buf.get_access<sycl::access::mode::read>(cgh);
-            auto edge_weight_acc = edge_weight_buf.get_access<sycl::access::mode::read>(cgh);
-            auto dist_acc = dist_buf.get_access<sycl::access::mode::read_write>(cgh);
-            auto bucket_acc = bucket_buf.get_access<sycl::access::mode::read>(cgh);
-            sycl::stream out(1024, 256, cgh); // stream for debugging
-
-            cgh.parallel_for<relax_light_edges>(sycl::range<1>(bucket.size()), [=](sycl::id<1> idx) {
-                int u = bucket_acc[idx];
-                for (int i = 0; i < E; i++) {
-                    if (edge_src_acc[i] == u && edge_weight_acc[i] <= DELTA) {
-                        int v = edge_dest_acc[i];
-                        int weight = edge_weight_acc[i];
-
-                        if (dist_acc[u] != INF && dist_acc[u] + weight < dist_acc[v]) {
-                            dist_acc[v] = dist_acc[u] + weight;
-                            // Debug 
-                            out << "Updating distance of vertex " << char('A' + v) << " to " << dist_acc[v] << " from vertex " << char('A' + u) << sycl::endl;
-                        }
-                    }
-                }
-            });
-        }).wait();
+    // Device-resident graph (not owned) and bucket structure:
+    //   pool             entries of the live buckets, pool_size of them; bucket b
+    //                    is stored in slot s = b % NB of a circular array, at
+    //                    pool[slot_offset[s] ..] with room for slot_offset[NB + s]
+    //                    entries, slot_count[s] of them appended
+    //   queued[v]        lowest bucket v has been appended to, INF when none
+    //   settled_in[v]    last bucket v was removed from, -1 before
+    //   frontier         vertices taken from the current bucket in this phase
+    //   settled          every vertex removed from the current bucket, for the heavy phase
+    //   taken_in[v]      last light phase v was put in the frontier, -1 before
+    int* row;
+    int* light_end;
+    int* edge_dest;
+    int* edge_weight;
+    int* in_row;
+    int* in_src;
+    int* in_weight;
+    int* dist_dev = nullptr;
+    int* pool = nullptr;
+    int pool_size = 0;
+    int* slot_count = nullptr;
+    int* slot_offset = nullptr;
+    int* queued = nullptr;
+    int* settled_in = nullptr;
+    int* frontier = nullptr;
+    int* settled = nullptr;
+    int* taken_in = nullptr;
+    int* counters = nullptr;
+    std::vector<int> slot_layout;  // host copy of slot_offset
+    RunStats last;
+    // Launches of the current run, kept only on a profiling queue and read
+    // once it has finished
+    bool profiling;
+    std::vector<std::pair<Phase, sycl::event>> events;
+    void record(Phase phase, sycl::event e) {
+        if (profiling) events.emplace_back(phase, e);
+    }
+
+    void release();
+    void layout();
+    void begin(int b);
+    void take(int b, int phase);
+    auto pusher() const;
+    void process_edges(const int* list, Counter count, bool light);
+    void pull_light(int b, int phase);
+    int next_bucket(int b, int& size);
+    void dump_distances(const char* phase, int b);
+};
+
+template <Verbosity Level>
+DeltaStepping<Level>::DeltaStepping(sycl::queue& q, const DeviceGraph& g)
+    : queue(q), V(g.V), E(g.E), DELTA(g.DELTA), grid(sycl::range<1>(WG), sycl::range<1>(WG)),
+      row(g.row), light_end(g.light_end), edge_dest(g.dest), edge_weight(g.weight),
+      in_row(g.in_row), in_src(g.in_src), in_weight(g.in_weight),
+      profiling(q.has_property<sycl::property::queue::enable_profiling>()) {
+    // A relaxation from bucket b lands in buckets b .. b + max_weight / DELTA + 1,
+    // so that many bucket frontiers are live at once; bucket b is stored in
+    // slot b % NB of a circular array. The slots share one pool that holds
+    // each waiting vertex once, see layout().
+    NB = g.max_weight / DELTA + 2;
+
+    const size_t max_groups = queue.get_device().get_info<sycl::info::device::max_compute_units>() * 4;
+    const size_t groups = std::max<size_t>(1, std::min<size_t>(max_groups, (V + WG - 1) / WG));
+    grid = sycl::nd_range<1>(sycl::range<1>(groups * WG), sycl::range<1>(WG));
+    stride = groups * WG;
+
+    try {
+        dist_dev = device_alloc<int>(V, queue);
+        pool_size = V + NB;
+        pool = device_alloc<int>(pool_size, queue);
+        slot_count = device_alloc<int>(NB, queue);
+        slot_offset = device_alloc<int>(2 * size_t(NB), queue);
+        queued = device_alloc<int>(V, queue);
+        settled_in = device_alloc<int>(V, queue);
+        frontier = device_alloc<int>(V, queue);
+        settled = device_alloc<int>(V, queue);
+        taken_in = device_alloc<int>(V, queue);
+        counters = device_alloc<int>(NUM_COUNTERS, queue);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+template <Verbosity Level>
+DeltaStepping<Level>::~DeltaStepping() {
+    release();
+}
+
+template <Verbosity Level>
+void DeltaStepping<Level>::release() {
+    for (int* ptr : {dist_dev, pool, slot_count, slot_offset, queued, settled_in, frontier, settled, taken_in, counters})
+        if (ptr) sycl::free(ptr, queue);
+}
+
+// Rebuild the buckets from queued[], which holds the bucket of every waiting
+// vertex: count the vertices per slot, give each slot room for its count plus
+// an even share of the rest of the pool, and append them again. Stale
+// entries disappear on the way, so the pool needs one entry per waiting
+// vertex. It starts with V + NB entries, room for every vertex plus one per
+// slot, and is regrown to twice the waiting vertices when they fill more
+// than half of it.
+// Runs at the start of a run and whenever an entry did not fit its slot.
+template <Verbosity Level>
+void DeltaStepping<Level>::layout() {
+    const int* queued = this->queued;
+    int* slot_count = this->slot_count;
+    int* counters = this->counters;
+    const int V = this->V, NB = this->NB;
+    const int stride = this->stride;
+    last.layouts++;
+
+    record(PHASE_LAYOUT, queue.fill(slot_count, 0, NB));
+    record(PHASE_LAYOUT, queue.parallel_for<count_buckets<Level>>(grid, [=](sycl::nd_item<1> item) {
+        for (int v = item.get_global_id(0); v < V; v += stride)
+            if (queued[v] != INF) atomic_int(slot_count[queued[v] % NB]).fetch_add(1);
+    }));
+    slot_layout.resize(2 * size_t(NB));
+    sycl::event copied = queue.memcpy(slot_layout.data() + NB, slot_count, NB * sizeof(int));
+    record(PHASE_TRANSFER, copied);
+    copied.wait();
+
+    size_t waiting = 0;
+    for (int s = 0; s < NB; s++) waiting += slot_layout[NB + s];
+    if (2 * waiting > size_t(pool_size)) {
+        sycl::free(pool, queue);
+        pool = nullptr;
+        pool = device_alloc<int>(2 * waiting, queue);
+        pool_size = 2 * waiting;
+    }
+    const int share = (pool_size - waiting) / NB;
+    for (int s = 0, offset = 0; s < NB; s++) {
+        slot_layout[s] = offset;
+        slot_layout[NB + s] += share;
+        offset += slot_layout[NB + s];
+    }
+    record(PHASE_TRANSFER, queue.memcpy(slot_offset, slot_layout.data(), 2 * NB * sizeof(int)));
+    last.transfer_bytes += 3 * size_t(NB) * sizeof(int);
+
+    int* pool = this->pool;
+    const int* slot_offset = this->slot_offset;
+    record(PHASE_LAYOUT, queue.fill(slot_count, 0, NB));
+    record(PHASE_LAYOUT, queue.fill(counters + SPILLED, 0, 1));
+    record(PHASE_LAYOUT, queue.parallel_for<fill_buckets<Level>>(grid, [=](sycl::nd_item<1> item) {
+        for (int v = item.get_global_id(0); v < V; v += stride)
+            if (queued[v] != INF) {
+                const int s = queued[v] % NB;
+                pool[slot_offset[s] + atomic_int(slot_count[s]).fetch_add(1)] = v;
+            }
+    }));
+}
+
+// Move the current slot list aside so relaxations can refill it
+template <Verbosity Level>
+void DeltaStepping<Level>::begin(int b) {
+    int* slot_count = this->slot_count;
+    int* counters = this->counters;
+    const int NB = this->NB;
+    record(PHASE_BEGIN, queue.single_task<begin_bucket<Level>>([=]() {
+        counters[TAKE] = slot_count[b % NB];
+        counters[FRONTIER] = 0;
+        slot_count[b % NB] = 0;
+    }));
+}
+
+// Compact the live entries of the slot into the frontier. Entries whose
+// vertex already moved to a lower bucket are stale and dropped; each
+// work-group reserves its output range with one atomic after a group scan.
+// Taken vertices are marked with the phase number for the pull kernel.
+template <Verbosity Level>
+void DeltaStepping<Level>::take(int b, int phase) {
+    const int* pool = this->pool;
+    const int* slot_offset = this->slot_offset;
+    int* dist_dev = this->dist_dev;
+    int* frontier = this->frontier;
+    int* settled = this->settled;
+    int* queued = this->queued;
+    int* settled_in = this->settled_in;
+    int* taken_in = this->taken_in;
+    int* counters = this->counters;
+    const int DELTA = this->DELTA, NB = this->NB;
+    const int stride = this->stride;
+
+    record(PHASE_TAKE, queue.parallel_for<take_bucket<Level>>(grid, [=](sycl::nd_item<1> item) {
+        auto g = item.get_group();
+        const int lid = item.get_local_id(0);
+        const int count = counters[TAKE];
+        const int* list = pool + slot_offset[b % NB];
+
+        for (int base = g.get_group_id(0) * WG; base < count; base += stride) {
+            const int k = base + lid;
+            const int v = (k < count) ? list[k] : 0;
+            const int keep = (k < count && dist_dev[v] / DELTA == b) ? 1 : 0;
+
+            const int offset = sycl::exclusive_scan_over_group(g, keep, sycl::plus<int>());
+            const int total = sycl::reduce_over_group(g, keep, sycl::plus<int>());
+            int start = 0;
+            if (lid == 0 && total > 0) start = atomic_int(counters[FRONTIER]).fetch_add(total);
+            start = sycl::group_broadcast(g, start, 0);
+
+            if (keep) {
+                frontier[start + offset] = v;
+                taken_in[v] = phase;
+                queued[v] = INF;
+                if (atomic_int(settled_in[v]).exchange(b) != b)
+                    settled[atomic_int(counters[SETTLED]).fetch_add(1)] = v;
+            }
+        }
+    }));
+}
+
+// Device function queueing v in the bucket of its new distance d unless it
+// already waits in that bucket or a lower one. An entry that does not fit
+// its slot is dropped and flags SPILLED; queued[v] still records it, and
+// next_bucket() lays the pool out again before anything is taken.
+template <Verbosity Level>
+auto DeltaStepping<Level>::pusher() const {
+    int* pool = this->pool;
+    int* slot_count = this->slot_count;
+    const int* slot_offset = this->slot_offset;
+    int* queued = this->queued;
+    int* counters = this->counters;
+    const int DELTA = this->DELTA, NB = this->NB;
+    return [=](int v, int d) {
+        const int nb = d / DELTA;
+        if (atomic_int(queued[v]).fetch_min(nb) > nb) {
+            const int s = nb % NB;
+            const int k = atomic_int(slot_count[s]).fetch_add(1);
+            if (k < slot_offset[NB + s])
+                pool[slot_offset[s] + k] = v;
+            else
+                atomic_int(counters[SPILLED]).store(1);
+        }
     };
+}
+
+// Relax the light or the heavy slice of every vertex in a work list.
+// Only at Verbosity::Relaxations does the kernel get a stream at all.
+template <Verbosity Level>
+void DeltaStepping<Level>::process_edges(const int* list, Counter count, bool light) {
+    const int* row = this->row;
+    const int* light_end = this->light_end;
+    const int* edge_dest = this->edge_dest;
+    const int* edge_weight = this->edge_weight;
+    int* dist_dev = this->dist_dev;
+    const int* counters = this->counters;
+    const int stride = this->stride;
+    auto push = pusher();
+
+    auto kernel = [=](sycl::nd_item<1> item, auto report) {
+        const int n = counters[count];
+        for (int k = item.get_global_id(0); k < n; k += stride) {
+            int u = list[k];
+            int du = load_distance(dist_dev[u]);
+            const int first = light ? row[u] : light_end[u];
+            const int last = light ? light_end[u] : row[u + 1];
+            for (int i = first; i < last; i++) {
+                int v = edge_dest[i];
+                int weight = edge_weight[i];
 
-    auto process_heavy_edges = [&](std::vector<int>& bucket) {
-        sycl::buffer<int, 1> bucket_buf(bucket.data(), bucket.size());
-
-        queue.submit([&](sycl::handler& cgh) {
-            auto edge_src_acc = edge_src_buf.get_access<sycl::access::mode::read>(cgh);
-            auto edge_dest_acc = edge_dest_buf.get_access<sycl::access::mode::read>(cgh);
-            auto edge_weight_acc = edge_weight_buf.get_access<sycl::access::mode::read>(cgh);
-            auto dist_acc = dist_buf.get_access<sycl::access::mode::read_write>(cgh);
-            auto bucket_acc = bucket_buf.get_access<sycl::access::mode::read>(cgh);
-            sycl::stream out(1024, 256, cgh); // Define a stream for debugging
-
-            cgh.parallel_for<relax_heavy_edges>(sycl::range<1>(bucket.size()), [=](sycl::id<1> idx) {
-                int u = bucket_acc[idx];
-                for (int i = 0; i < E; i++) {
-                    if (edge_src_acc[i] == u && edge_weight_acc[i] > DELTA) {
-                        int v = edge_dest_acc[i];
-                        int weight = edge_weight_acc[i];
-
-                        if (dist_acc[u] != INF && dist_acc[u] + weight < dist_acc[v]) {
-                            dist_acc[v] = dist_acc[u] + weight;
-                            // Debug statement 
-                            out << "Updating distance of vertex " << char('A' + v) << " to " << dist_acc[v] << " from vertex " << char('A' + u) << sycl::endl;
-                        }
-                    }
+                if (du != INF && relax(dist_dev[v], du + weight)) {
+                    push(v, du + weight);
+                    report(u, v, du + weight);
                 }
-            });
-        }).wait();
+            }
+        }
     };
 
-    std::cout << "Initial distances:\n";
-    print_distances(dist);
-
-    for (int i = 0; i < buckets.size(); ++i) {
-        if (buckets[i].empty()) continue; // Skip empty buckets
-        std::cout << "\nProcessing bucket " << i << ":\n";
-        print_buckets(buckets);
-
-        while (!buckets[i].empty()) {
-            std::vector<int> bucket = std::move(buckets[i]);
-            process_light_edges(bucket);
-
-            std::cout << "\nDistances after processing light edges of bucket " << i << ":\n";
-            queue.submit([&](sycl::handler& cgh) {
-                auto dist_acc = dist_buf.get_access<sycl::access::mode::read>(cgh);
-                cgh.host_task([=]() {
-                    for (int j = 0; j < V; ++j) {
-                        std::cout << "Vertex " << char('A' + j) << " distance: " << dist_acc[j] << "\n";
-                    }
+    record(light ? PHASE_PUSH_LIGHT : PHASE_RELAX_HEAVY, queue.submit([&](sycl::handler& cgh) {
+        if constexpr (Level >= Verbosity::Relaxations) {
+            sycl::stream out(1024, 256, cgh);
+            cgh.parallel_for<relax_edges<Level>>(grid, [=](sycl::nd_item<1> item) {
+                kernel(item, [&](int u, int v, int d) {
+                    out << "Updating distance of vertex " << char('A' + v) << " to " << d << " from vertex " << char('A' + u) << sycl::endl;
                 });
-            }).wait();
-
-            for (int u : bucket) {
-                for (int j = 0; j < E; j++) {
-                    if (edge_src[j] == u) {
-                        int v = edge_dest[j];
-                        int weight = edge_weight[j];
-
-                        if (dist[v] < INF) {
-                            int new_bucket_idx = dist[v] / DELTA;
-                            if (new_bucket_idx > i) { // Ensure vertices are added to later buckets only
-                                if (new_bucket_idx >= buckets.size()) {
-                                    buckets.resize(new_bucket_idx + 1);
-                                }
-                                if (std::find(buckets[new_bucket_idx].begin(), buckets[new_bucket_idx].end(), v) == buckets[new_bucket_idx].end()) {
-                                    buckets[new_bucket_idx].push_back(v);
-                                    std::cout << "Adding vertex " << char('A' + v) << " to bucket " << new_bucket_idx << "\n";
-                                }
-                            }
-                        }
-                    }
+            });
+        } else {
+            cgh.parallel_for<relax_edges<Level>>(grid, [=](sycl::nd_item<1> item) {
+                kernel(item, [](int, int, int) {});
+            });
+        }
+    }));
+}
+
+// Light phase of bucket b in pull direction: every vertex not settled in an
+// earlier bucket takes the minimum over its light in-edges from vertices
+// taken in this phase, and only then updates its own distance once.
+template <Verbosity Level>
+void DeltaStepping<Level>::pull_light(int b, int phase) {
+    const int* in_row = this->in_row;
+    const int* in_src = this->in_src;
+    const int* in_weight = this->in_weight;
+    const int* settled_in = this->settled_in;
+    const int* taken_in = this->taken_in;
+    int* dist_dev = this->dist_dev;
+    const int V = this->V;
+    const int stride = this->stride;
+    auto push = pusher();
+
+    auto kernel = [=](sycl::nd_item<1> item, auto report) {
+        for (int v = item.get_global_id(0); v < V; v += stride) {
+            // Settled in an earlier bucket: the distance is final
+            if (settled_in[v] >= 0 && settled_in[v] < b) continue;
+            int best = INF, from = -1;
+            for (int i = in_row[v]; i < in_row[v + 1]; i++) {
+                int u = in_src[i];
+                if (taken_in[u] != phase) continue;
+                int du = load_distance(dist_dev[u]);
+                if (du != INF && du + in_weight[i] < best) {
+                    best = du + in_weight[i];
+                    from = u;
                 }
             }
-            process_heavy_edges(bucket);
+            if (best != INF && relax(dist_dev[v], best)) {
+                push(v, best);
+                report(from, v, best);
+            }
+        }
+    };
 
-            std::cout << "\nDistances after processing heavy edges of bucket " << i << ":\n";
-            queue.submit([&](sycl::handler& cgh) {
-                auto dist_acc = dist_buf.get_access<sycl::access::mode::read>(cgh);
-                cgh.host_task([=]() {
-                    for (int j = 0; j < V; ++j) {
-                        std::cout << "Vertex " << char('A' + j) << " distance: " << dist_acc[j] << "\n";
-                    }
+    record(PHASE_PULL_LIGHT, queue.submit([&](sycl::handler& cgh) {
+        if constexpr (Level >= Verbosity::Relaxations) {
+            sycl::stream out(1024, 256, cgh);
+            cgh.parallel_for<pull_light_edges<Level>>(grid, [=](sycl::nd_item<1> item) {
+                kernel(item, [&](int u, int v, int d) {
+                    out << "Updating distance of vertex " << char('A' + v) << " to " << d << " from vertex " << char('A' + u) << sycl::endl;
                 });
-            }).wait();
+            });
+        } else {
+            cgh.parallel_for<pull_light_edges<Level>>(grid, [=](sycl::nd_item<1> item) {
+                kernel(item, [](int, int, int) {});
+            });
         }
+    }));
+}
+
+// The only values read back per phase: the lowest non-empty bucket from
+// b on, or -1 when every bucket is empty, the entries of its slot (an upper
+// bound on its frontier, stale entries included), and whether an entry was
+// spilled, in which case the pool is laid out again and the search repeated.
+template <Verbosity Level>
+int DeltaStepping<Level>::next_bucket(int b, int& size) {
+    const int* slot_count = this->slot_count;
+    int* counters = this->counters;
+    const int NB = this->NB;
+    record(PHASE_NEXT_BUCKET, queue.single_task<find_next_bucket<Level>>([=]() {
+        int next = -1;
+        for (int k = 0; k < NB && next < 0; k++)
+            if (slot_count[(b + k) % NB] > 0) next = b + k;
+        counters[NEXT] = next;
+        counters[NEXT_SIZE] = next < 0 ? 0 : slot_count[next % NB];
+    }));
+    int result[3];
+    sycl::event copied = queue.memcpy(result, counters + NEXT, sizeof(result));
+    record(PHASE_TRANSFER, copied);
+    last.transfer_bytes += sizeof(result);
+    copied.wait();
+    if (result[2]) {
+        layout();
+        return next_bucket(b, size);
     }
+    size = result[1];
+    return result[0];
+}
 
-    std::cout << "\nFinal distances:\n";
-    print_distances(dist);
+template <Verbosity Level>
+void DeltaStepping<Level>::dump_distances(const char* phase, int b) {
+    if constexpr (Level >= Verbosity::Phases) {
+        std::vector<int> dist(V);
+        queue.memcpy(dist.data(), dist_dev, V * sizeof(int)).wait();
+        std::cout << "\nDistances after processing " << phase << " edges of bucket " << b << ":\n";
+        for (int j = 0; j < V; ++j) {
+            std::cout << "Vertex " << char('A' + j) << " distance: " << dist[j] << "\n";
+        }
+    }
+}
+
+template <Verbosity Level>
+std::vector<int> DeltaStepping<Level>::run(int src) {
+    std::vector<int> dist(V, INF);
+    dist[src] = 0;
+
+    last = RunStats();
+    events.clear();
+    record(PHASE_TRANSFER, queue.memcpy(dist_dev, dist.data(), V * sizeof(int)));
+    record(PHASE_INIT, queue.fill(queued, INF, V));
+    record(PHASE_INIT, queue.fill(settled_in, -1, V));
+    record(PHASE_INIT, queue.fill(taken_in, -1, V));
+    record(PHASE_INIT, queue.fill(counters, 0, NUM_COUNTERS));
+    record(PHASE_INIT, queue.fill(queued + src, 0, 1));
+    layout();
+
+    if constexpr (Level >= Verbosity::Phases) {
+        std::cout << "Initial distances:\n";
+        print_distances(dist);
+    }
+
+    for (int i = 0, size = 1; i >= 0;) {
+        last.buckets++;
+        if constexpr (Level >= Verbosity::Phases)
+            std::cout << "\nProcessing bucket " << i << ":\n";
+
+        // Light edges may refill bucket i; repeat until it stays empty
+        int next;
+        do {
+            const int phase = last.phases++;
+            begin(i);
+            take(i, phase);
+            if (size > V / PULL_RATIO) {
+                pull_light(i, phase);
+                last.pull_phases++;
+            } else {
+                process_edges(frontier, FRONTIER, true);
+            }
+            next = next_bucket(i, size);
+            dump_distances("light", i);
+        } while (next == i);
+
+        process_edges(settled, SETTLED, false);
+        record(PHASE_INIT, queue.fill(counters + SETTLED, 0, 1));
+        dump_distances("heavy", i);
+        i = next_bucket(i, size);
+    }
+
+    record(PHASE_TRANSFER, queue.memcpy(dist.data(), dist_dev, V * sizeof(int)));
+    queue.wait();
+    last.transfer_bytes += 2 * size_t(V) * sizeof(int);
+
+    if (profiling) {
+        last.profiled = true;
+        for (const auto& [phase, e] : events) last.phase_us[phase] += event_us(e);
+        events.clear();
+    }
+    return dist;
+}
+
+template <Verbosity Level = kVerbosity>
+std::vector<int> deltaStepping(const std::vector<Edge>& edges, int src, int V, int E, int DELTA) {
+    // Flattened graph representation -> Unable to use complex objects in vectors for kernel parallel execution
+    CSRGraph graph = buildCSR(edges, V, DELTA);
+
+    sycl::queue queue(sycl::default_selector_v, sycl::property::queue::in_order());
+    std::cout << "Running on "
+              << queue.get_device().get_info<sycl::info::device::name>()
+              << "\n";
+
+    DeviceGraph device_graph(queue, graph, DELTA);
+    DeltaStepping<Level> solver(queue, device_graph);
+    return solver.run(src);
+}
+
+// Answer a batch of sources on one device graph. Each of nqueues in-order
+// queues gets its own solver driven by a host thread, so the phases of
+// independent queries overlap on the device instead of waiting on each
+// other's host round trips. on_result(k, dist, stats, seconds) is called for
+// sources[k] as soon as that query finishes, one call at a time, from the
+// worker thread, with the stats of its solver and its time on its queue
+// (which overlaps the other queries); it may keep dist by moving it.
+// The first error of a worker, such as a failed allocation, stops the batch
+// and is rethrown here.
+template <Verbosity Level = kVerbosity, typename F>
+void solveBatch(const DeviceGraph& graph, const std::vector<int>& sources, int nqueues, F on_result) {
+    sycl::queue base = graph.queue;
+    std::atomic<size_t> next{0};
+    std::mutex result_mutex;
+    std::exception_ptr error;
+    nqueues = std::max(1, std::min<int>(nqueues, sources.size()));
+
+    parallel_run(nqueues, [&](int) {
+        try {
+            sycl::queue queue(base.get_context(), base.get_device(), sycl::property::queue::in_order());
+            DeltaStepping<Level> solver(queue, graph);
+            for (size_t k = next++; k < sources.size(); k = next++) {
+                const auto t0 = std::chrono::steady_clock::now();
+                std::vector<int> dist = solver.run(sources[k]);
+                const std::chrono::duration<double> t = std::chrono::steady_clock::now() - t0;
+                std::lock_guard<std::mutex> lock(result_mutex);
+                on_result(k, dist, solver.stats(), t.count());
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(result_mutex);
+            if (!error) error = std::current_exception();
+            next = sources.size();
+        }
+    });
+    if (error) std::rethrow_exception(error);
 }
 
 
@@ -226,14 +875,401 @@ std::vector<Edge> generateRandomGraph(const int num_vertices, const int num_edge
     return edges;
 }
 
-std::vector<Edge> readGraphFromFile(std::string filename);
 
-int main() {
+// Read-only mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                data = static_cast<const char*>(map);
+                size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+const char* parse_int(const char* p, const char* end, int& value) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    auto res = std::from_chars(p, end, value);
+    if (res.ec != std::errc()) throw std::runtime_error("malformed number in graph file");
+    return res.ptr;
+}
+
+// DIMACS shortest-path format: "p sp V E" once, then "a u v w" per arc with
+// 1-based vertices; "c" lines are comments. The arc lines are split into one
+// chunk per thread at line boundaries and parsed concurrently.
+CSRGraph readDimacs(const MappedFile& file) {
+    const char* begin = file.data;
+    const char* end = file.data + file.size;
+
+    int V = -1, E = 0;
+    const char* p = begin;
+    while (p < end && V < 0) {
+        const char* eol = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        if (eol - p > 4 && std::strncmp(p, "p sp", 4) == 0) p = parse_int(parse_int(p + 4, eol, V), eol, E);
+        p = eol + 1;
+    }
+    if (V < 0) throw std::runtime_error("missing 'p sp' line in DIMACS file");
+
+    const int nt = num_threads();
+    std::vector<const char*> cut(nt + 1, end);
+    cut[0] = std::min(p, end);
+    for (int t = 1; t < nt; t++) {
+        const char* c = std::max(cut[t - 1], cut[0] + (end - cut[0]) * t / nt);
+        const char* eol = static_cast<const char*>(std::memchr(c, '\n', end - c));
+        cut[t] = eol ? eol + 1 : end;
+    }
+
+    std::vector<std::vector<Edge>> parts(nt);
+    std::vector<std::string> errors(nt);
+    parallel_run(nt, [&](int t) {
+        parts[t].reserve(size_t(E) / nt + 1);
+        try {
+            for (const char* q = cut[t]; q < cut[t + 1];) {
+                const char* eol = static_cast<const char*>(std::memchr(q, '\n', cut[t + 1] - q));
+                if (!eol) eol = cut[t + 1];
+                if (*q == 'a') {
+                    Edge e;
+                    q = parse_int(parse_int(parse_int(q + 1, eol, e.src), eol, e.dest), eol, e.weight);
+                    if (e.src < 1 || e.src > V || e.dest < 1 || e.dest > V)
+                        throw std::runtime_error("arc endpoint out of range");
+                    if (e.weight < 0) throw std::runtime_error("negative arc weight");
+                    e.src--;
+                    e.dest--;
+                    parts[t].push_back(e);
+                }
+                q = eol + 1;
+            }
+        } catch (const std::exception& ex) {
+            errors[t] = ex.what();
+        }
+    });
+    for (const auto& err : errors)
+        if (!err.empty()) throw std::runtime_error(err);
+
+    return buildCSR(parts, V);
+}
+
+// Binary edge list (native endianness, 0-based vertices):
+//   int32 V, int32 E, then E records of int32 {src, dest, weight}
+CSRGraph readBinary(const MappedFile& file) {
+    int32_t header[2];
+    if (file.size < sizeof(header)) throw std::runtime_error("truncated binary graph");
+    std::memcpy(header, file.data, sizeof(header));
+    const int V = header[0], E = header[1];
+    if (V < 0 || E < 0 || file.size < sizeof(header) + size_t(E) * sizeof(Edge))
+        throw std::runtime_error("truncated binary graph");
+
+    const char* records = file.data + sizeof(header);
+    const int nt = num_threads();
+    std::vector<std::vector<Edge>> parts(nt);
+    parallel_run(nt, [&](int t) {
+        const size_t first = size_t(E) * t / nt, last = size_t(E) * (t + 1) / nt;
+        parts[t].resize(last - first);
+        std::memcpy(parts[t].data(), records + first * sizeof(Edge), (last - first) * sizeof(Edge));
+    });
+    for (const auto& part : parts)
+        for (const auto& e : part) {
+            if (e.src < 0 || e.src >= V || e.dest < 0 || e.dest >= V)
+                throw std::runtime_error("edge endpoint out of range");
+            if (e.weight < 0) throw std::runtime_error("negative edge weight");
+        }
+
+    return buildCSR(parts, V);
+}
+
+// .gr files are DIMACS text, anything else the binary edge list.
+CSRGraph readGraphFromFile(std::string filename) {
+    MappedFile file(filename);
+    if (!file.data) throw std::runtime_error("cannot open " + filename);
+    if (filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".gr") == 0)
+        return readDimacs(file);
+    return readBinary(file);
+}
+
+void writeBinaryGraph(const CSRGraph& g, const std::string& filename) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) throw std::runtime_error("cannot write " + filename);
+    const int32_t header[2] = {g.V, g.E};
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    std::vector<Edge> records;
+    records.reserve(g.E);
+    for (int u = 0; u < g.V; u++)
+        for (int i = g.row[u]; i < g.row[u + 1]; i++) records.push_back({u, g.dest[i], g.weight[i]});
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(Edge));
+}
+
+// Sequential reference for validation
+std::vector<int> dijkstra(const CSRGraph& g, int src) {
+    std::vector<int> dist(g.V, INF);
+    using Item = std::pair<int, int>;
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item>> pq;
+    dist[src] = 0;
+    pq.push({0, src});
+    while (!pq.empty()) {
+        auto [d, u] = pq.top();
+        pq.pop();
+        if (d > dist[u]) continue;
+        for (int i = g.row[u]; i < g.row[u + 1]; i++) {
+            int v = g.dest[i];
+            if (d + g.weight[i] < dist[v]) {
+                dist[v] = d + g.weight[i];
+                pq.push({dist[v], v});
+            }
+        }
+    }
+    return dist;
+}
+
+struct BenchmarkOptions {
+    std::string graph;
+    std::string save;
+    int delta = 0;  // 0 picks DELTA with chooseDelta and retunes it between sources
+    int sources = 8;
+    int queues = 1;  // more than one answers the sources as a batch, see solveBatch
+    unsigned seed = 1;
+    bool validate = false;
+    int warmup = 0;  // untimed runs from the first source
+    bool profile = false;  // device time per phase from the queue's events
+    std::string json;  // results for regression tracking
+};
+
+// Retune an automatic DELTA from the last run. Buckets holding far fewer
+// vertices than one launch processes mean mostly idle launches, so DELTA
+// grows; many light phases per bucket mean Bellman-Ford style re-relaxation,
+// so it shrinks.
+int retuneDelta(const CSRGraph& g, int delta, const RunStats& stats, int reached, int parallelism) {
+    if (stats.buckets == 0) return delta;
+    const double per_bucket = double(reached) / stats.buckets;
+    const double phases_per_bucket = double(stats.phases) / stats.buckets;
+    if (per_bucket < parallelism / 8.0 && phases_per_bucket < 2.0 && delta < g.max_weight)
+        return delta * 2;
+    if (phases_per_bucket > 4.0)
+        return std::max(1, delta / 2);
+    return delta;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Load a graph, solve from several random sources and report MTEPS: the
+// out-edges of all reached vertices per microsecond of solve time.
+int benchmark(const BenchmarkOptions& opt) {
+    auto t0 = std::chrono::steady_clock::now();
+    CSRGraph graph = readGraphFromFile(opt.graph);
+    const double t_load = seconds_since(t0);
+    std::cout << "Graph " << opt.graph << ": " << graph.V << " vertices, " << graph.E << " edges, max weight "
+              << graph.max_weight << "\n";
+    std::cout << "Load time: " << t_load << " s\n";
+
+    if (!opt.save.empty()) {
+        writeBinaryGraph(graph, opt.save);
+        std::cout << "Saved binary edge list to " << opt.save << "\n";
+    }
+
+    t0 = std::chrono::steady_clock::now();
+    const bool auto_delta = opt.delta <= 0;
+    int delta = auto_delta ? chooseDelta(graph) : opt.delta;
+    splitLightHeavy(graph, delta);
+    sycl::queue queue = opt.profile ? sycl::queue(sycl::default_selector_v,
+                                                  sycl::property_list{sycl::property::queue::in_order(),
+                                                                      sycl::property::queue::enable_profiling()})
+                                    : sycl::queue(sycl::default_selector_v, sycl::property::queue::in_order());
+    const std::string device = queue.get_device().get_info<sycl::info::device::name>();
+    std::cout << "Running on " << device << "\n";
+    auto device_graph = std::make_unique<DeviceGraph>(queue, graph, delta);
+    auto solver = std::make_unique<DeltaStepping<>>(queue, *device_graph);
+    std::cout << "Setup time (split, upload): " << seconds_since(t0) << " s, DELTA = " << delta
+              << (auto_delta ? " (auto)" : "") << "\n";
+
+    // Sources with at least one out-edge, reproducible through the seed
+    std::mt19937 gen(opt.seed);
+    std::uniform_int_distribution<int> vertex_dis(0, std::max(0, graph.V - 1));
+    std::vector<int> sources;
+    for (int tries = 0; int(sources.size()) < opt.sources && tries < 100 * opt.sources; tries++) {
+        int s = vertex_dis(gen);
+        if (graph.row[s + 1] > graph.row[s]) sources.push_back(s);
+    }
+
+    // Out-edges of the vertices a result reached, and their number
+    auto traversed_edges = [&](const std::vector<int>& dist, int& reached) {
+        double edges = 0.0;
+        reached = 0;
+        for (int u = 0; u < graph.V; u++)
+            if (dist[u] != INF) {
+                edges += graph.row[u + 1] - graph.row[u];
+                reached++;
+            }
+        return edges;
+    };
+    // Ends the line printed for a result with the validation verdict
+    int failures = 0;
+    auto validate = [&](int src, const std::vector<int>& dist) {
+        if (opt.validate) {
+            std::vector<int> ref = dijkstra(graph, src);
+            int bad = 0;
+            for (int u = 0; u < graph.V; u++) bad += dist[u] != ref[u];
+            std::cout << (bad ? ", FAILED (" + std::to_string(bad) + " wrong distances)" : ", valid");
+            failures += bad != 0;
+        }
+        std::cout << "\n";
+    };
+
+    // Per source: seconds, MTEPS and the stats of its run
+    struct SourceResult {
+        int src;
+        double seconds, mteps;
+        RunStats stats;
+    };
+    std::vector<SourceResult> results;
+
+    double t_solve = 0.0, traversed = 0.0;
+    if (opt.queues > 1) {
+        // Batched: all sources on one device graph. The results are only
+        // collected while the batch is timed, and reported and validated after.
+        solver.reset();
+        std::vector<std::vector<int>> dists(sources.size());
+        results.resize(sources.size());
+        t0 = std::chrono::steady_clock::now();
+        solveBatch(*device_graph, sources, opt.queues,
+                   [&](size_t k, std::vector<int>& dist, const RunStats& stats, double t) {
+                       dists[k] = std::move(dist);
+                       results[k] = {sources[k], t, 0.0, stats};
+                   });
+        t_solve = seconds_since(t0);
+        for (size_t k = 0; k < sources.size(); k++) {
+            SourceResult& r = results[k];
+            int reached;
+            const double edges = traversed_edges(dists[k], reached);
+            r.mteps = edges / r.seconds * 1e-6;
+            traversed += edges;
+            std::cout << "Source " << r.src << ": query " << k << ", " << r.seconds << " s, " << r.mteps << " MTEPS, "
+                      << reached << " vertices reached, " << r.stats.buckets << " buckets";
+            validate(r.src, dists[k]);
+        }
+        std::cout << "Batch time: " << t_solve << " s on " << opt.queues << " queues";
+        if (!sources.empty()) std::cout << ", " << sources.size() / t_solve << " queries/s";
+        std::cout << "\n";
+    } else {
+        for (int w = 0; w < opt.warmup && !sources.empty(); w++) solver->run(sources[0]);
+        for (int src : sources) {
+            t0 = std::chrono::steady_clock::now();
+            std::vector<int> dist = solver->run(src);
+            const double t = seconds_since(t0);
+
+            int reached;
+            const double edges = traversed_edges(dist, reached);
+            const RunStats stats = solver->stats();
+            std::cout << "Source " << src << ": " << t << " s, " << edges / t * 1e-6 << " MTEPS, " << stats.buckets
+                      << " buckets, " << stats.phases << " light phases (" << stats.pull_phases << " pull), " << stats.layouts << " layouts";
+            validate(src, dist);
+            if (stats.profiled) {
+                std::cout << "  device us:";
+                for (int p = 0; p < NUM_PHASES; p++) std::cout << " " << phase_names[p] << " " << stats.phase_us[p];
+                std::cout << ", " << stats.transfer_bytes << " bytes copied\n";
+            }
+            results.push_back({src, t, edges / t * 1e-6, stats});
+            t_solve += t;
+            traversed += edges;
+
+            if (auto_delta) {
+                const int tuned = retuneDelta(graph, delta, stats, reached, solver->parallelism());
+                if (tuned != delta) {
+                    delta = tuned;
+                    solver.reset();
+                    device_graph.reset();
+                    splitLightHeavy(graph, delta);
+                    device_graph = std::make_unique<DeviceGraph>(queue, graph, delta);
+                    solver = std::make_unique<DeltaStepping<>>(queue, *device_graph);
+                    std::cout << "Retuned DELTA to " << delta << "\n";
+                }
+            }
+        }
+    }
+
+    if (!sources.empty())
+        std::cout << "Solve time: " << t_solve / sources.size() << " s per source, " << traversed / t_solve * 1e-6
+                  << " MTEPS over " << sources.size() << " sources\n";
+    if (opt.validate) std::cout << (failures ? "Validation FAILED\n" : "Validation passed\n");
+
+    if (!opt.json.empty()) {
+        std::ofstream out(opt.json);
+        if (!out) throw std::runtime_error("cannot write " + opt.json);
+        out << "{\n  \"module\": \"04-sssp\",\n  \"device\": \"" << device << "\",\n  \"graph\": \"" << opt.graph
+            << "\",\n  \"vertices\": " << graph.V << ",\n  \"edges\": " << graph.E << ",\n  \"delta\": " << delta
+            << ",\n  \"queues\": " << opt.queues << ",\n  \"warmup\": " << opt.warmup << ",\n  \"solve_s\": " << t_solve
+            << ",\n  \"mteps\": " << (t_solve > 0.0 ? traversed / t_solve * 1e-6 : 0.0) << ",\n  \"sources\": [";
+        for (size_t k = 0; k < results.size(); k++) {
+            const SourceResult& r = results[k];
+            out << (k ? ",\n" : "\n") << "    {\"source\": " << r.src << ", \"seconds\": " << r.seconds
+                << ", \"mteps\": " << r.mteps << ", \"buckets\": " << r.stats.buckets << ", \"phases\": " << r.stats.phases
+                << ", \"pull_phases\": " << r.stats.pull_phases << ", \"layouts\": " << r.stats.layouts << ", \"transfer_bytes\": " << r.stats.transfer_bytes;
+            if (r.stats.profiled) {
+                out << ", \"device_us\": {";
+                for (int p = 0; p < NUM_PHASES; p++)
+                    out << (p ? ", \"" : "\"") << phase_names[p] << "\": " << r.stats.phase_us[p];
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    BenchmarkOptions opt;
+    std::string delta = "auto";
+    CLI::App app{"Delta-stepping SSSP: the Wiki graph, or a benchmark on --graph"};
+    app.add_option("--graph", opt.graph, "DIMACS .gr file or binary edge list")->check(CLI::ExistingFile);
+    app.add_option("--delta", delta, "Bucket width, a positive integer or auto")
+        ->check(CLI::IsMember({"auto"}) | (CLI::TypeValidator<int>() & CLI::PositiveNumber))
+        ->capture_default_str();
+    app.add_option("--sources", opt.sources, "Random sources to solve")->check(CLI::PositiveNumber)->capture_default_str();
+    app.add_option("--queues", opt.queues, "Queues answering the sources as a batch")
+        ->check(CLI::PositiveNumber)
+        ->capture_default_str();
+    app.add_option("--seed", opt.seed, "Seed of the random sources")->capture_default_str();
+    app.add_option("--save", opt.save, "Write the loaded graph as a binary edge list");
+    app.add_flag("--validate", opt.validate, "Compare every result with a sequential Dijkstra");
+    app.add_option("--warmup", opt.warmup, "Untimed runs from the first source")
+        ->check(CLI::NonNegativeNumber)
+        ->capture_default_str();
+    app.add_flag("--profile", opt.profile, "Device time per phase from the queue's events");
+    app.add_option("--json", opt.json, "Write the results as JSON");
+    CLI11_PARSE(app, argc, argv);
+    opt.delta = delta == "auto" ? 0 : std::stoi(delta);
+
+    if (!opt.graph.empty()) {
+        try {
+            return benchmark(opt);
+        } catch (const std::exception& ex) {
+            std::cerr << "Error: " << ex.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+
     ////////////////////////////////////////////////////
-    constexpr int V = 7;  // Number of vertices 
+    constexpr int V = 7;  // Number of vertices
     constexpr int E = 7; // Number of edges
     constexpr int DELTA = 3; // Bucket size
-    ////////////////////////////////////////////////////    
+    ////////////////////////////////////////////////////
 
 
     // // Generate a Sparse graph
@@ -243,7 +1279,10 @@ int main() {
     // Generate Wiki graph
     std::vector<Edge> edges = generateWikiGraph();
     // print_graph(edges);
-    deltaStepping(edges, 0, V, E, DELTA); // Source is A (vertex 0)
+    std::vector<int> dist = deltaStepping(edges, 0, V, E, DELTA); // Source is A (vertex 0)
+
+    std::cout << "\nFinal distances:\n";
+    print_distances(dist);
 
-    return 0;       
+    return 0;
 }